@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""Performance regression suite.
+
+Runs a fixed matrix of perf_meas scenarios a number of times each, and
+compares throughput and deletemin p99 latency against a stored
+baseline for this machine class. Throughput has regressed when its
+median is worse than the baseline median by more than the threshold,
+and a one-sided Mann-Whitney U test on the trials finds the difference
+significant. perf_meas reports p99 as the upper bound of a power of
+two bucket, so p99 is compared by bucket index instead: it has
+regressed when its median is in a higher bucket than the baseline
+median, and the U test agrees. Throughput is measured with the
+threads pinned and without latency sampling, whose rdtsc per operation
+and prefix walks would perturb it; latency comes from a separate run.
+Exits non-zero on regression, and when there is no baseline.
+
+    bench.py [--save] [--threshold PCT] [--trials N] [--secs S]
+             [--machine NAME] [--baseline FILE]
+"""
+
+import argparse
+import itertools
+import json
+import math
+import os
+import platform
+import re
+import subprocess
+import sys
+
+SCENARIOS = {
+    "uniform":   ["-s", "32768"],
+    "des":       ["-e", "-s", "32768"],
+    "prodcons":  ["-p", "-s", "32768"],
+    "largequeue": ["-s", "1048576"],
+}
+
+# (name, from the -l run, index in the -x output, higher is better,
+#  log2 bucket)
+METRICS = [("ops_per_sec", False, 0, True, False),
+           ("deletemin_p99", True, 5, False, True)]
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def machine_class():
+    model = platform.machine()
+    try:
+        with open("/proc/cpuinfo") as f:
+            m = re.search(r"model name\s*:\s*(.*)", f.read())
+            if m:
+                model = m.group(1)
+    except IOError:
+        pass
+    slug = re.sub(r"[^a-z0-9]+", "-", model.lower()).strip("-")
+    return "%s-%dcpu" % (slug, os.cpu_count())
+
+
+def run(args, scenario, latency):
+    threads = max(args.threads, 2)
+    cmd = [os.path.join(HERE, "perf_meas"), "-x",
+           "-n", str(threads), "-t", str(args.secs)] + SCENARIOS[scenario]
+    if latency:
+        cmd.append("-l")
+    # pinned, unless there are more threads than cpus
+    if threads > os.cpu_count():
+        cmd.append("-u")
+    out = subprocess.check_output(cmd, universal_newlines=True).split()
+    return [float(v) for v in out]
+
+
+def mann_whitney_p(worse, better):
+    """One-sided p-value that the samples in worse are stochastically
+    smaller than those in better. Exact for small samples, normal
+    approximation otherwise."""
+    n1, n2 = len(worse), len(better)
+    pooled = sorted(worse + better)
+
+    def rank(v):
+        lo = pooled.index(v)
+        hi = len(pooled) - pooled[::-1].index(v)
+        return (lo + hi + 1) / 2.0
+
+    ranks = [rank(v) for v in pooled]
+    u = sum(rank(v) for v in worse) - n1 * (n1 + 1) / 2.0
+    if n1 + n2 <= 20:
+        hits = total = 0
+        for comb in itertools.combinations(range(n1 + n2), n1):
+            uc = sum(ranks[i] for i in comb) - n1 * (n1 + 1) / 2.0
+            hits += uc <= u
+            total += 1
+        return hits / float(total)
+    mu = n1 * n2 / 2.0
+    sigma = math.sqrt(n1 * n2 * (n1 + n2 + 1) / 12.0)
+    return 0.5 * math.erfc((mu - u) / (sigma * math.sqrt(2)))
+
+
+def bucket_index(v):
+    """Index of the power of two bucket with upper bound v."""
+    return int(round(math.log2(v))) if v > 0 else 0
+
+
+def median(xs):
+    xs = sorted(xs)
+    n = len(xs)
+    return xs[n // 2] if n % 2 else (xs[n // 2 - 1] + xs[n // 2]) / 2.0
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__,
+                                formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--save", action="store_true",
+                   help="store the results as the new baseline")
+    p.add_argument("--threshold", type=float, default=5.0,
+                   help="allowed slowdown of a median, in percent")
+    p.add_argument("--alpha", type=float, default=0.05,
+                   help="significance level of the U test")
+    # with fewer than 4 trials per side, p never drops below 0.05
+    p.add_argument("--trials", type=int, default=5)
+    p.add_argument("--secs", type=int, default=2)
+    p.add_argument("--threads", type=int, default=os.cpu_count())
+    p.add_argument("--machine", default=machine_class())
+    p.add_argument("--baseline")
+    args = p.parse_args()
+
+    path = args.baseline or os.path.join(HERE, "baselines", args.machine + ".json")
+
+    results = {}
+    for s in SCENARIOS:
+        runs = {lat: [run(args, s, lat) for _ in range(args.trials)]
+                for lat in (False, True)}
+        results[s] = {m: [r[i] for r in runs[lat]]
+                      for m, lat, i, _, _ in METRICS}
+        print("%-12s %s" % (s, "  ".join("%s %.0f" % (m, median(results[s][m]))
+                                         for m, _, _, _, _ in METRICS)))
+
+    if args.save:
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, "w") as f:
+            json.dump({"machine": args.machine, "threads": args.threads,
+                       "secs": args.secs, "results": results},
+                      f, indent=2, sort_keys=True)
+        print("baseline written to %s" % path)
+        return 0
+
+    if not os.path.exists(path):
+        print("no baseline %s, create one with 'make bench-baseline'" % path)
+        return 2
+
+    with open(path) as f:
+        base = json.load(f)["results"]
+
+    failed = False
+    for s in SCENARIOS:
+        for m, _, _, higher, bucket in METRICS:
+            cur, old = results[s][m], base[s][m]
+            if bucket:
+                cur = [bucket_index(v) for v in cur]
+                old = [bucket_index(v) for v in old]
+                pval = mann_whitney_p([-v for v in cur], [-v for v in old])
+                change = median(cur) - median(old)
+                bad = change > 0 and pval < args.alpha
+                print("%-12s %-14s %+5.1f bkt  p=%.3f  %s"
+                      % (s, m, change, pval, "REGRESSION" if bad else "ok"))
+                failed |= bad
+                continue
+            change = (median(cur) - median(old)) / median(old) * 100
+            if higher:
+                pval = mann_whitney_p(cur, old)
+                slower = -change
+            else:
+                pval = mann_whitney_p([-v for v in cur], [-v for v in old])
+                slower = change
+            bad = slower > args.threshold and pval < args.alpha
+            failed |= bad
+            print("%-12s %-14s %+7.1f%%  p=%.3f  %s"
+                  % (s, m, change, pval, "REGRESSION" if bad else "ok"))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
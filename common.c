@@ -61,6 +61,14 @@ timediff (struct timespec begin, struct timespec end)
     return tmp;
 }
 
+void
+rng_seed (unsigned short rng[3], unsigned long seed)
+{
+    rng[0] = seed;
+    rng[1] = seed >> 16;
+    rng[2] = seed >> 32;
+}
+
 void
 rng_init (unsigned short rng[3])
 {
@@ -70,8 +78,5 @@ rng_init (unsigned short rng[3])
     clock_gettime(CLOCK_REALTIME, &time);
 
     /* initialize seed */
-    rng[0] = time.tv_nsec;
-    rng[1] = time.tv_nsec >> 16;
-    rng[2] = time.tv_nsec >> 32;
-
+    rng_seed(rng, time.tv_nsec);
 }
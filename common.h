@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #if defined(__linux__)
 #include <time.h>
@@ -47,6 +48,8 @@ typedef struct thread_args_s
     unsigned short rng[3];
     int measure;
     int cycles;
+    /* log2 histogram of operation latencies, in cycles */
+    unsigned long lat[64];
     char pad[128];
 } thread_args_t;
 
@@ -96,18 +99,28 @@ read_tsc_p()
 	 : "%rcx", "%rdx");
    return tsc;
 }
-
-/* compiler memory barrier */
-#define CMB() __asm__ __volatile__ ("" : : : "memory")
-
-#define IMB()    __asm__ __volatile__("mfence":::"memory")
-#define IRMB()   __asm__ __volatile__("lfence":::"memory")
-#define IWMB()   __asm__ __volatile__("sfence":::"memory")
-
+#elif defined(__aarch64__)
+/* virtual counter, lower resolution than the tsc */
+static inline uint64_t __attribute__((always_inline))
+read_tsc_p()
+{
+   uint64_t t;
+   __asm__ __volatile__ ("isb\n"
+	 "mrs %0, cntvct_el0"
+	 : "=r"(t));
+   return t;
+}
 #else
 #error Unsupported architecture
 #endif // __x86_64__
 
+/* compiler memory barrier */
+#define CMB()    atomic_signal_fence(memory_order_seq_cst)
+
+#define IMB()    atomic_thread_fence(memory_order_seq_cst)
+#define IRMB()   atomic_thread_fence(memory_order_acquire)
+#define IWMB()   atomic_thread_fence(memory_order_release)
+
 
 #if defined(__linux__)
 extern pid_t gettid(void);
@@ -115,6 +128,7 @@ extern void  pin(pid_t t, int cpu);
 #endif
 
 void rng_init (unsigned short rng[3]);
+void rng_seed (unsigned short rng[3], unsigned long seed);
 extern void gettime(struct timespec *t);
 extern struct timespec timediff(struct timespec, struct timespec);
 
@@ -0,0 +1,257 @@
+/**
+ * Priority task executor on top of the queue.
+ *
+ * Tasks are allocated by exec_submit() and embed their queue link,
+ * so the queue needs no nodes of its own. A task is freed by the
+ * reuse hook of the queue, once no worker can see it anymore.
+ *
+ * A worker parks on a condition variable only after it has counted
+ * itself in sleepers and found the queue empty once more, and a
+ * submitter signals after its insert whenever sleepers is non-zero,
+ * so a task is never left in the queue with all workers parked.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "executor.h"
+
+/* deletemin offset of the task queue */
+#define EXEC_OFFSET 32
+
+typedef struct
+{
+    exec_fn_t fn;
+    void     *arg;
+    pq_link_t link;
+} task_t;
+
+/* what a worker keeps of a task it has taken */
+typedef struct
+{
+    exec_fn_t fn;
+    void     *arg;
+} job_t;
+
+typedef struct
+{
+    pthread_t thread;
+    exec_t   *ex;
+    int       id;
+    _Atomic unsigned long tasks;
+    _Atomic unsigned long batches;
+    _Atomic unsigned long polls;
+    _Atomic unsigned long parks;
+    char      pad[128];
+} worker_t;
+
+struct exec_s
+{
+    pq_t             *pq;
+    int               nworkers;
+    int               pinned;
+    worker_t         *workers;
+    _Atomic unsigned long seq;
+    _Atomic long      pending;  /* submitted, not run yet */
+    _Atomic int       stopping;
+    _Atomic int       sleepers;
+    pthread_mutex_t   lock;
+    pthread_cond_t    wake;
+};
+
+
+static void
+task_reclaimed(pq_link_t *l)
+{
+    free((task_t *)((char *)l - offsetof(task_t, link)));
+}
+
+static inline void
+count(_Atomic unsigned long *c, unsigned long n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed)
+                          + n, memory_order_relaxed);
+}
+
+/* Take up to EXEC_BATCH tasks. Their fields are read inside the
+ * session, as the tasks may be freed right after it. */
+static int
+take_batch(exec_t *ex, job_t *batch)
+{
+    pq_link_t *l;
+    task_t *t;
+    int n = 0;
+
+    pq_session_begin();
+    while (n < EXEC_BATCH && (l = pq_link_deletemin(ex->pq)) != NULL) {
+        t = (task_t *)((char *)l - offsetof(task_t, link));
+        batch[n].fn = t->fn;
+        batch[n++].arg = t->arg;
+    }
+    pq_session_end();
+    return n;
+}
+
+static void
+run_batch(exec_t *ex, worker_t *w, job_t *batch, int n)
+{
+    for (int i = 0; i < n; i++)
+        batch[i].fn(batch[i].arg);
+    count(&w->tasks, n);
+    count(&w->batches, 1);
+    atomic_fetch_sub(&ex->pending, n);
+}
+
+/* Sleep until a task is submitted, unless the queue turns out not to
+ * be empty after all. */
+static int
+park(exec_t *ex, worker_t *w, job_t *batch)
+{
+    int n;
+
+    pthread_mutex_lock(&ex->lock);
+    atomic_fetch_add(&ex->sleepers, 1);
+    n = take_batch(ex, batch);
+    if (!n && !atomic_load(&ex->stopping)) {
+        count(&w->parks, 1);
+        pthread_cond_wait(&ex->wake, &ex->lock);
+    }
+    atomic_fetch_sub(&ex->sleepers, 1);
+    pthread_mutex_unlock(&ex->lock);
+    return n;
+}
+
+static void *
+worker(void *_w)
+{
+    worker_t *w = _w;
+    exec_t *ex = w->ex;
+    job_t batch[EXEC_BATCH];
+    int n, idle = 0;
+
+    if (ex->pinned)
+        pin(gettid(), w->id % sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (;;) {
+        n = take_batch(ex, batch);
+        if (!n && idle >= EXEC_SPINS) {
+            n = park(ex, w, batch);
+            idle = 0;
+        }
+        if (n) {
+            run_batch(ex, w, batch, n);
+            idle = 0;
+            continue;
+        }
+        if (atomic_load(&ex->stopping) && atomic_load(&ex->pending) == 0)
+            break;
+        count(&w->polls, 1);
+        idle++;
+        sched_yield();
+    }
+    return NULL;
+}
+
+
+exec_t *
+exec_init(int nworkers, int pinned)
+{
+    exec_t *ex;
+
+    assert(nworkers > 0);
+    E_NULL(ex = malloc(sizeof *ex));
+    if (ex == NULL)
+        return NULL;
+    if ((ex->pq = pq_init_intrusive(EXEC_OFFSET, task_reclaimed)) == NULL) {
+        free(ex);
+        return NULL;
+    }
+    ex->nworkers = nworkers;
+    ex->pinned = pinned;
+    atomic_init(&ex->seq, 0);
+    atomic_init(&ex->pending, 0);
+    atomic_init(&ex->stopping, 0);
+    atomic_init(&ex->sleepers, 0);
+    pthread_mutex_init(&ex->lock, NULL);
+    pthread_cond_init(&ex->wake, NULL);
+
+    ex->workers = calloc(nworkers, sizeof *ex->workers);
+    for (int i = 0; i < nworkers; i++) {
+        ex->workers[i].ex = ex;
+        ex->workers[i].id = i;
+        E_en(pthread_create(&ex->workers[i].thread, NULL, worker,
+                            &ex->workers[i]));
+    }
+    return ex;
+}
+
+int
+exec_submit(exec_t *ex, unsigned long prio, exec_fn_t fn, void *arg)
+{
+    task_t *t;
+    unsigned long s;
+
+    assert(prio <= EXEC_MAX_PRIO);
+    /* counted before the check, so that shutdown waits for it */
+    atomic_fetch_add(&ex->pending, 1);
+    if (atomic_load(&ex->stopping)) {
+        atomic_fetch_sub(&ex->pending, 1);
+        return -1;
+    }
+
+    E_NULL(t = malloc(sizeof *t));
+    if (t == NULL) {
+        atomic_fetch_sub(&ex->pending, 1);
+        return -1;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    /* the sequence number keeps keys unique, and ties in order up to
+     * its wrap, see executor.h */
+    do {
+        s = atomic_fetch_add_explicit(&ex->seq, 1, memory_order_relaxed);
+    } while (!pq_link_insert(ex->pq, &t->link, ((prio << EXEC_SEQ_BITS) |
+                             (s & ((1UL << EXEC_SEQ_BITS) - 1))) + 1));
+
+    /* pairs with the increment of sleepers in park() */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&ex->sleepers)) {
+        pthread_mutex_lock(&ex->lock);
+        pthread_cond_signal(&ex->wake);
+        pthread_mutex_unlock(&ex->lock);
+    }
+    return 0;
+}
+
+void
+exec_stats(exec_t *ex, int w, exec_stats_t *s)
+{
+    worker_t *x = &ex->workers[w];
+
+    s->tasks   = atomic_load_explicit(&x->tasks, memory_order_relaxed);
+    s->batches = atomic_load_explicit(&x->batches, memory_order_relaxed);
+    s->polls   = atomic_load_explicit(&x->polls, memory_order_relaxed);
+    s->parks   = atomic_load_explicit(&x->parks, memory_order_relaxed);
+}
+
+void
+exec_shutdown(exec_t *ex)
+{
+    pthread_mutex_lock(&ex->lock);
+    atomic_store(&ex->stopping, 1);
+    pthread_cond_broadcast(&ex->wake);
+    pthread_mutex_unlock(&ex->lock);
+
+    for (int i = 0; i < ex->nworkers; i++)
+        pthread_join(ex->workers[i].thread, NULL);
+
+    pq_destroy(ex->pq);
+    pthread_mutex_destroy(&ex->lock);
+    pthread_cond_destroy(&ex->wake);
+    free(ex->workers);
+    free(ex);
+}
@@ -0,0 +1,55 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "prioq.h"
+
+/* Priority task executor.
+ *
+ * A fixed pool of worker threads runs (priority, fn, arg) tasks,
+ * lowest priority value first, taken from an intrusive queue. Tasks
+ * of equal priority run in submission order, by a sequence number in
+ * the low EXEC_SEQ_BITS bits of the key. It wraps every
+ * 2^EXEC_SEQ_BITS submissions, and a task submitted after a wrap may
+ * run before the tasks of its priority still queued from before it,
+ * however few submissions lie in between. A worker takes up
+ * to EXEC_BATCH tasks per GC critical section, polls the queue
+ * EXEC_SPINS times when it is empty, and then parks until a task is
+ * submitted. */
+
+#define EXEC_SEQ_BITS 20
+#define EXEC_MAX_PRIO ((1UL << (64 - EXEC_SEQ_BITS)) - 2)
+#define EXEC_BATCH    16
+#define EXEC_SPINS    64
+
+typedef void (*exec_fn_t)(void *arg);
+
+/* Per-worker counters. */
+typedef struct
+{
+    unsigned long tasks;   /* tasks run */
+    unsigned long batches; /* non-empty batches taken */
+    unsigned long polls;   /* polls of an empty queue */
+    unsigned long parks;   /* times gone to sleep */
+} exec_stats_t;
+
+typedef struct exec_s exec_t;
+
+/* Start nworkers workers; if pinned, worker i runs on cpu i modulo
+ * the number of cpus, see pin(). Returns NULL if the queue cannot be
+ * created, see pq_init(). */
+extern exec_t *exec_init(int nworkers, int pinned);
+
+/* Queue a task, from any thread, also from a running task. Returns
+ * -1 once exec_shutdown() has begun, or if the task cannot be
+ * allocated, else 0. */
+extern int exec_submit(exec_t *ex, unsigned long prio, exec_fn_t fn,
+                       void *arg);
+
+/* Copy the counters of worker w. */
+extern void exec_stats(exec_t *ex, int w, exec_stats_t *s);
+
+/* Refuse new tasks, wait until all submitted tasks have run, stop
+ * the workers and free the executor. */
+extern void exec_shutdown(exec_t *ex);
+
+#endif // EXECUTOR_H
@@ -0,0 +1,132 @@
+/**
+ * Flight recorder, per-thread rings of timestamped events.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "flight.h"
+
+#define CALIBRATE_USECS 10000
+
+__thread flight_ring_t *flight_ring;
+static flight_ring_t *ring_list = NULL;
+static uint16_t next_thread = 0;
+static const char *signal_path;
+
+static const char *ev_names[] = {
+    [EV_SWING]       = "swing",
+    [EV_RESTRUCTURE] = "restructure",
+    [EV_EPOCH]       = "epoch",
+    [EV_MALLOC]      = "malloc",
+    [EV_TRIM]        = "trim",
+};
+
+
+flight_ring_t *
+flight_ring_new(void)
+{
+    flight_ring_t *r, *next;
+
+    E_NULL(r = calloc(1, sizeof *r));
+    r->thread = __sync_fetch_and_add(&next_thread, 1);
+    do {
+        next = ring_list;
+        r->next = next;
+    } while (!__sync_bool_compare_and_swap(&ring_list, next, r));
+    return r;
+}
+
+
+static int
+ev_cmp(const void *a, const void *b)
+{
+    const flight_ev_t *x = a, *y = b;
+    return x->tsc < y->tsc ? -1 : x->tsc > y->tsc;
+}
+
+
+/* Cycles per microsecond, measured against the monotonic clock. */
+static double
+tsc_per_us(void)
+{
+    struct timespec t0, t1, d;
+    uint64_t c0, c1;
+
+    gettime(&t0);
+    c0 = read_tsc_p();
+    usleep(CALIBRATE_USECS);
+    gettime(&t1);
+    c1 = read_tsc_p();
+    d = timediff(t0, t1);
+    return (c1 - c0) / (d.tv_sec * 1e6 + d.tv_nsec / 1e3);
+}
+
+
+void
+flight_dump(FILE *out)
+{
+    flight_ev_t *all;
+    size_t n = 0, cap = 0;
+
+    for (flight_ring_t *r = ring_list; r; r = r->next)
+        cap += FLIGHT_RING_SIZE;
+    E_NULL(all = malloc((cap + 1) * sizeof *all));
+
+    for (flight_ring_t *r = ring_list; r; r = r->next) {
+        unsigned long end = r->pos;
+        unsigned long start = end > FLIGHT_RING_SIZE ? end - FLIGHT_RING_SIZE : 0;
+        for (unsigned long i = start; i < end; i++)
+            all[n++] = r->ev[i & (FLIGHT_RING_SIZE - 1)];
+    }
+    qsort(all, n, sizeof *all, ev_cmp);
+
+    fprintf(out, "# tsc_per_us %.3f\n", tsc_per_us());
+    fprintf(out, "# tsc thread event dur arg\n");
+    for (size_t i = 0; i < n; i++)
+        fprintf(out, "%" PRIu64 " %u %s %u %u\n", all[i].tsc, all[i].thread,
+                ev_names[all[i].type], all[i].dur, all[i].arg);
+    free(all);
+}
+
+
+/* Dumps outside of signal context, so that it may use stdio and
+ * malloc, which a handler could have interrupted. */
+static void *
+dump_thread(void *arg)
+{
+    sigset_t *set = arg;
+    FILE *f;
+    int sig;
+
+    for (;;) {
+        if (sigwait(set, &sig) != 0)
+            continue;
+        if ((f = fopen(signal_path, "w")) == NULL)
+            continue;
+        flight_dump(f);
+        fclose(f);
+    }
+    return NULL;
+}
+
+
+void
+flight_dump_on_signal(int sig, const char *path)
+{
+    static sigset_t set;
+    pthread_t t;
+
+    signal_path = path;
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    /* inherited by the threads created later, so only sigwait() gets it */
+    E_en(pthread_sigmask(SIG_BLOCK, &set, NULL));
+    E_en(pthread_create(&t, NULL, dump_thread, &set));
+    E_en(pthread_detach(t));
+}
@@ -0,0 +1,77 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include "common.h"
+
+/* Flight recorder. Each thread keeps the last FLIGHT_RING_SIZE queue
+ * and GC events in its own ring buffer, timestamped with read_tsc_p().
+ * Recording is compiled in with FLIGHT_RECORDER (make FLIGHT=true),
+ * otherwise flight_event() is a no-op. */
+
+#define FLIGHT_RING_SIZE 4096 /* power of two */
+
+enum {
+    EV_SWING = 1,   /* head swung, arg: nodes freed */
+    EV_RESTRUCTURE, /* restructure, dur: cycles */
+    EV_EPOCH,       /* gc epoch advanced, arg: new epoch */
+    EV_MALLOC,      /* gc refill from malloc, arg: KiB, dur: cycles */
+    EV_TRIM,        /* bounded queue trimmed, arg: nodes freed, dur: cycles */
+};
+
+typedef struct
+{
+    uint64_t tsc;
+    uint32_t dur;
+    uint32_t arg;
+    uint16_t type;
+    uint16_t thread;
+} flight_ev_t;
+
+typedef struct flight_ring_s
+{
+    struct flight_ring_s *next;
+    uint16_t     thread;
+    unsigned long pos;
+    flight_ev_t  ev[FLIGHT_RING_SIZE];
+} flight_ring_t;
+
+extern __thread flight_ring_t *flight_ring;
+extern flight_ring_t *flight_ring_new(void);
+
+#ifdef FLIGHT_RECORDER
+static inline void
+flight_event(int type, uint64_t tsc, uint64_t dur, uint32_t arg)
+{
+    flight_ring_t *r = flight_ring;
+    flight_ev_t *e;
+
+    if (r == NULL)
+        flight_ring = r = flight_ring_new();
+    e = &r->ev[r->pos & (FLIGHT_RING_SIZE - 1)];
+    e->tsc = tsc;
+    e->dur = min(dur, (uint64_t) UINT32_MAX);
+    e->arg = arg;
+    e->type = type;
+    e->thread = r->thread;
+    CMB();
+    r->pos++;
+}
+#define flight_tsc() read_tsc_p()
+#else
+#define flight_event(_type, _tsc, _dur, _arg) \
+    ((void)(_tsc), (void)(_dur), (void)(_arg))
+#define flight_tsc() 0
+#endif
+
+/* Write the events of all threads, merged in time order, as text.
+ * Racy against threads still recording; the oldest events of a ring
+ * may be overwritten while it is copied. */
+extern void flight_dump(FILE *out);
+
+/* Dump to PATH whenever SIG is received, from a thread of its own
+ * that waits for it with sigwait(). SIG is blocked in the calling
+ * thread, so call this before other threads are created, for them to
+ * inherit the mask. */
+extern void flight_dump_on_signal(int sig, const char *path);
+
+#endif // FLIGHT_H
@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+"""Convert a flight recorder dump (flight_dump()) to the Chrome trace
+event format, for chrome://tracing or Perfetto.
+
+    flight2chrome.py DUMP > trace.json
+"""
+
+import json
+import sys
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    per_us = 1.0
+    t0 = None
+    events = []
+    with open(sys.argv[1]) as f:
+        for line in f:
+            if line.startswith("# tsc_per_us"):
+                per_us = float(line.split()[2])
+                continue
+            if line.startswith("#"):
+                continue
+            tsc, thread, name, dur, arg = line.split()
+            tsc = int(tsc)
+            if t0 is None:
+                t0 = tsc
+            ev = {"name": name, "pid": 0, "tid": int(thread),
+                  "ts": (tsc - t0) / per_us, "args": {"arg": int(arg)}}
+            if int(dur):
+                ev["ph"] = "X"
+                ev["dur"] = int(dur) / per_us
+            else:
+                ev["ph"] = "i"
+                ev["s"] = "t"
+            events.append(ev)
+    json.dump({"traceEvents": events, "displayTimeUnit": "ns"}, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,51 @@
+/******************************************************************************
+ * arena.c
+ *
+ * Contiguous memory arena.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+/* Blocks start at this alignment. */
+#define ARENA_ALIGN 64
+
+arena_t *arena_create(size_t size)
+{
+    arena_t *a = malloc(sizeof(*a));
+    if ( a == NULL ) return NULL;
+
+    a->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( a->base == MAP_FAILED )
+    {
+        free(a);
+        return NULL;
+    }
+    a->size = size;
+    /* offset 0 is kept free, so that it can mean NULL */
+    a->used = ARENA_ALIGN;
+    return a;
+}
+
+
+void arena_destroy(arena_t *a)
+{
+    munmap(a->base, a->size);
+    free(a);
+}
+
+
+void *arena_alloc(arena_t *a, size_t size)
+{
+    size_t off;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    off  = __sync_fetch_and_add(&a->used, size);
+    if ( off + size > a->size ) return NULL;
+    return a->base + off;
+}
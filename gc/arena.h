@@ -0,0 +1,31 @@
+/******************************************************************************
+ * arena.h
+ *
+ * Contiguous memory arena. Blocks are carved off with a bump pointer
+ * and never returned; recycling is left to the garbage collector,
+ * see gc_add_arena_allocator(). Keeping all blocks in one region lets
+ * them be addressed by 32-bit offsets from the base.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+typedef struct arena_st
+{
+    char            *base;
+    size_t           size;
+    volatile size_t  used;
+} arena_t;
+
+/* Reserve @size bytes of address space. Pages are backed on use. */
+arena_t *arena_create(size_t size);
+void arena_destroy(arena_t *a);
+
+/* Carve @size bytes off the arena, NULL when exhausted. */
+void *arena_alloc(arena_t *a, size_t size);
+
+#endif /* __ARENA_H__ */
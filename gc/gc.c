@@ -44,6 +44,8 @@
 #include <unistd.h>
 #include "portable_defns.h"
 #include "gc.h"
+#include "arena.h"
+#include "../flight.h"
 
 /*#define MINIMAL_GC*/
 /*#define YIELD_TO_HELP_PROGRESS*/
@@ -54,7 +56,7 @@
 #define INITIALISE_NODES(_p,_c) memset((_p), INVALID_BYTE, (_c));
 
 /* Number of unique block sizes we can deal with. */
-#define MAX_SIZES 32
+#define MAX_SIZES 128
 
 #define MAX_HOOKS 4
 
@@ -103,11 +105,11 @@ static struct gc_global_st
     CACHE_PAD(0);
 
     /* The current epoch. */
-    VOLATILE unsigned int current;
+    _Atomic unsigned int current;
     CACHE_PAD(1);
 
     /* Exclusive access to gc_reclaim(). */
-    VOLATILE unsigned int inreclaim;
+    _Atomic unsigned int inreclaim;
     CACHE_PAD(2);
 
     /*
@@ -120,6 +122,8 @@ static struct gc_global_st
     /* Node sizes (run-time constants). */
     int nr_sizes;
     int blk_sizes[MAX_SIZES];
+    /* Where blocks come from, the heap if NULL. */
+    arena_t *arenas[MAX_SIZES];
 
     /* Registered epoch hooks. */
     int nr_hooks;
@@ -136,18 +140,19 @@ static struct gc_global_st
     /* Main allocation lists. */
     chunk_t * VOLATILE alloc[MAX_SIZES];
     VOLATILE unsigned int alloc_size[MAX_SIZES];
-#ifdef PROFILE_GC
-    VOLATILE unsigned int total_size;
+
+    /* Heap obtained for blocks so far (cheap, only touched on refill). */
+    _Atomic unsigned long total_size;
+    _Atomic unsigned long heap_size[MAX_SIZES];
     VOLATILE unsigned int allocations;
-#endif
 } gc_global;
 
 
 /* Per-thread state. */
 struct gc_st
 {
-    /* Epoch that this thread sees. */
-    unsigned int epoch;
+    /* Epoch that this thread sees. Written by the owner only. */
+    _Atomic unsigned int epoch;
 
     /* Number of calls to gc_entry() since last gc_reclaim() attempt. */
     unsigned int entries_since_reclaim;
@@ -209,8 +214,8 @@ static void add_chunks_to_list(chunk_t *ch, chunk_t *head)
 {
     chunk_t *h_next, *new_h_next, *ch_next;
     ch_next    = ch->next;
-    new_h_next = head->next;
-    do { ch->next = h_next = new_h_next; WMB_NEAR_CAS(); }
+    new_h_next = LOAD_ACQ(&head->next);
+    do { h_next = new_h_next; STORE_RLX(&ch->next, h_next); WMB_NEAR_CAS(); }
     while ( (new_h_next = CASPO(&head->next, h_next, ch_next)) != h_next );
 }
 
@@ -223,14 +228,14 @@ static chunk_t *get_empty_chunks(int n)
 
  retry:
     head = gc_global.free_chunks;
-    new_rh = head->next;
+    new_rh = LOAD_ACQ(&head->next);
     do {
         rh = new_rh;
         rt = head;
         WEAK_DEP_ORDER_RMB();
         for ( i = 0; i < n; i++ )
         {
-            if ( (rt = rt->next) == head )
+            if ( (rt = LOAD_ACQ(&rt->next)) == head )
             {
                 /* Allocate some more chunks. */
                 add_chunks_to_list(alloc_more_chunks(), head);
@@ -238,27 +243,35 @@ static chunk_t *get_empty_chunks(int n)
             }
         }
     }
-    while ( (new_rh = CASPO(&head->next, rh, rt->next)) != rh );
+    while ( (new_rh = CASPO(&head->next, rh, LOAD_ACQ(&rt->next))) != rh );
 
-    rt->next = rh;
+    /* others may still be reading it, before their CAS fails */
+    STORE_RLX(&rt->next, rh);
     return(rh);
 }
 
 
 /* Get @n filled chunks, pointing at blocks of @sz bytes each. */
-static chunk_t *get_filled_chunks(unsigned int n, unsigned int sz)
+static chunk_t *get_filled_chunks(unsigned int n, unsigned int sz,
+                                  arena_t *arena)
 {
     chunk_t *h, *p;
     char *node;
     int i;
 
-#ifdef PROFILE_GC
-    ADD_TO(gc_global.total_size, n * BLKS_PER_CHUNK * sz);
+    atomic_fetch_add_explicit(&gc_global.total_size,
+                              (unsigned long)n * BLKS_PER_CHUNK * sz,
+                              memory_order_relaxed);
     ADD_TO(gc_global.allocations, 1);
-#endif
 
-    node = ALIGNED_ALLOC(n * BLKS_PER_CHUNK * sz);
+    uint64_t t0 = flight_tsc();
+    if ( arena != NULL )
+        node = arena_alloc(arena, (size_t) n * BLKS_PER_CHUNK * sz);
+    else
+        node = ALIGNED_ALLOC(n * BLKS_PER_CHUNK * sz);
     if ( node == NULL ) MEM_FAIL((unsigned long) n * BLKS_PER_CHUNK * sz);
+    flight_event(EV_MALLOC, t0, flight_tsc() - t0,
+                 ((unsigned long) n * BLKS_PER_CHUNK * sz) >> 10);
 #ifdef WEAK_MEM_ORDER
     INITIALISE_NODES(node, n * BLKS_PER_CHUNK * sz);
 #endif
@@ -304,24 +317,28 @@ static chunk_t *get_alloc_chunk(gc_t *gc, int i)
     unsigned int sz;
 
     alloc = gc_global.alloc[i];
-    new_p = alloc->next;
+    new_p = LOAD_ACQ(&alloc->next);
 
     do {
         p = new_p;
         while ( p == alloc )
         {
-            sz = gc_global.alloc_size[i];
-            nh = get_filled_chunks(sz, gc_global.blk_sizes[i]);
+            sz = LOAD_ACQ(&gc_global.alloc_size[i]);
+            nh = get_filled_chunks(sz, gc_global.blk_sizes[i],
+                                   gc_global.arenas[i]);
+            atomic_fetch_add_explicit(&gc_global.heap_size[i], (unsigned long)
+                                      sz * BLKS_PER_CHUNK * gc_global.blk_sizes[i],
+                                      memory_order_relaxed);
             ADD_TO(gc_global.alloc_size[i], sz >> 3);
             gc_async_barrier(gc);
             add_chunks_to_list(nh, alloc);
-            p = alloc->next;
+            p = LOAD_ACQ(&alloc->next);
         }
         WEAK_DEP_ORDER_RMB();
     }
-    while ( (new_p = CASPO(&alloc->next, p, p->next)) != p );
+    while ( (new_p = CASPO(&alloc->next, p, LOAD_ACQ(&p->next))) != p );
 
-    p->next = p;
+    STORE_RLX(&p->next, p);
     assert(p->i == BLKS_PER_CHUNK);
     return(p);
 }
@@ -338,25 +355,34 @@ static void gc_reclaim(ptst_t * our_ptst)
 {
     ptst_t       *ptst, *first_ptst; //, *our_ptst = NULL;
     gc_t         *gc = NULL;
-    unsigned long curr_epoch;
+    unsigned int  curr_epoch, zero = 0;
     chunk_t      *ch, *t;
     int           two_ago, three_ago, i, j;
     
     /* Barrier to entering the reclaim critical section. */
-    if ( gc_global.inreclaim || CASIO(&gc_global.inreclaim, 0, 1) ) return;
+    if ( atomic_load_explicit(&gc_global.inreclaim, memory_order_relaxed) ||
+         !atomic_compare_exchange_strong_explicit(
+             &gc_global.inreclaim, &zero, 1,
+             memory_order_acquire, memory_order_relaxed) ) return;
 
     /*
      * Grab first ptst structure *before* barrier -- prevent bugs
-     * on weak-ordered architectures.
+     * on weak-ordered architectures. The barrier orders our
+     * earlier store to the epoch before the loads of the thread
+     * counts below; it pairs with the one in gc_enter().
      */
     first_ptst = ptst_first();
     MB();
-    curr_epoch = gc_global.current;
+    curr_epoch = atomic_load_explicit(&gc_global.current, memory_order_relaxed);
 
-    /* Have all threads seen the current epoch, or not in mutator code? */
+    /* Have all threads seen the current epoch, or not in mutator code?
+     * Acquire pairs with the release in gc_exit(): whatever a thread
+     * did in its critical section happens before the reclaim. */
     for ( ptst = first_ptst; ptst != NULL; ptst = ptst_next(ptst) )
     {
-        if ( (ptst->count > 1) && (ptst->gc->epoch != curr_epoch) ) goto out;
+        if ( (atomic_load_explicit(&ptst->count, memory_order_acquire) > 1) &&
+             (atomic_load_explicit(&ptst->gc->epoch, memory_order_relaxed)
+              != curr_epoch) ) goto out;
     }
 
     /*
@@ -376,9 +402,9 @@ static void gc_reclaim(ptst_t * our_ptst)
             /* NB. Leave one chunk behind, as it is probably not yet full. */
             t = gc->garbage[three_ago][i];
             if ( (t == NULL) || ((ch = t->next) == t) ) continue;
-            gc->garbage_tail[three_ago][i]->next = ch;
+            STORE_RLX(&gc->garbage_tail[three_ago][i]->next, ch);
             gc->garbage_tail[three_ago][i] = t;
-            t->next = t;
+            STORE_RLX(&t->next, t);
             add_chunks_to_list(ch, gc_global.alloc[i]);
         }
 
@@ -398,11 +424,12 @@ static void gc_reclaim(ptst_t * our_ptst)
     }
 
     /* Update current epoch. */
-    WMB();
-    gc_global.current = (curr_epoch+1) % NR_EPOCHS;
+    atomic_store_explicit(&gc_global.current, (curr_epoch+1) % NR_EPOCHS,
+                          memory_order_release);
+    flight_event(EV_EPOCH, flight_tsc(), 0, (curr_epoch+1) % NR_EPOCHS);
 
  out:
-    gc_global.inreclaim = 0;
+    atomic_store_explicit(&gc_global.inreclaim, 0, memory_order_release);
 }
 #endif /* MINIMAL_GC */
 
@@ -425,8 +452,9 @@ void *gc_alloc(ptst_t *ptst, int alloc_id)
         {
             chunk_t *och = ch;
             ch = get_alloc_chunk(gc, alloc_id);
-            ch->next  = och->next;
-            och->next = ch;
+            /* stale readers of the free chunk list may still load these */
+            STORE_RLX(&ch->next, och->next);
+            STORE_RLX(&och->next, ch);
             gc->alloc[alloc_id] = ch;        
         }
     }
@@ -445,8 +473,10 @@ static chunk_t *chunk_from_cache(gc_t *gc)
     }
     else
     {
-        ch->next = p->next;
-        p->next  = p;
+        /* a thread that lost a race in get_empty_chunks() may still
+         * be reading these */
+        STORE_RLX(&ch->next, p->next);
+        STORE_RLX(&p->next, p);
     }
 
     p->i = 0;
@@ -458,20 +488,21 @@ void gc_free(ptst_t *ptst, void *p, int alloc_id)
 {
 #ifndef MINIMAL_GC
     gc_t *gc = ptst->gc;
-    chunk_t *prev, *new, *ch = gc->garbage[gc->epoch][alloc_id];
+    unsigned int e = atomic_load_explicit(&gc->epoch, memory_order_relaxed);
+    chunk_t *prev, *new, *ch = gc->garbage[e][alloc_id];
 
     if ( ch == NULL )
     {
-        gc->garbage[gc->epoch][alloc_id] = ch = chunk_from_cache(gc);
-        gc->garbage_tail[gc->epoch][alloc_id] = ch;
+        gc->garbage[e][alloc_id] = ch = chunk_from_cache(gc);
+        gc->garbage_tail[e][alloc_id] = ch;
     }
     else if ( ch->i == BLKS_PER_CHUNK )
     {
-        prev = gc->garbage_tail[gc->epoch][alloc_id];
+        prev = gc->garbage_tail[e][alloc_id];
         new  = chunk_from_cache(gc);
-        gc->garbage[gc->epoch][alloc_id] = new;
-        new->next  = ch;
-        prev->next = new;
+        gc->garbage[e][alloc_id] = new;
+        STORE_RLX(&new->next, ch);
+        STORE_RLX(&prev->next, new);
         ch = new;
     }
 
@@ -483,21 +514,22 @@ void gc_free(ptst_t *ptst, void *p, int alloc_id)
 void gc_add_ptr_to_hook_list(ptst_t *ptst, void *ptr, int hook_id)
 {
     gc_t *gc = ptst->gc;
-    chunk_t *och, *ch = gc->hook[gc->epoch][hook_id];
+    unsigned int e = atomic_load_explicit(&gc->epoch, memory_order_relaxed);
+    chunk_t *och, *ch = gc->hook[e][hook_id];
 
     if ( ch == NULL )
     {
-        gc->hook[gc->epoch][hook_id] = ch = chunk_from_cache(gc);
+        gc->hook[e][hook_id] = ch = chunk_from_cache(gc);
     }
     else
     {
         ch = ch->next;
         if ( ch->i == BLKS_PER_CHUNK )
         {
-            och       = gc->hook[gc->epoch][hook_id];
+            och       = gc->hook[e][hook_id];
             ch        = chunk_from_cache(gc);
-            ch->next  = och->next;
-            och->next = ch;
+            STORE_RLX(&ch->next, och->next);
+            STORE_RLX(&och->next, ch);
         }
     }
 
@@ -522,24 +554,35 @@ void gc_unsafe_free(ptst_t *ptst, void *p, int alloc_id)
 }
 
 
+/*
+ * The count is written by the owner only. Entering stores it, then
+ * loads the epoch; the reclaimer stores the epoch, then loads the
+ * counts. Each side needs a full barrier in between, so that at least
+ * one of them sees the other.
+ */
 void gc_enter(ptst_t *ptst)
 {
+    unsigned int cnt = atomic_load_explicit(&ptst->count, memory_order_relaxed);
 #ifdef MINIMAL_GC
-    ptst->count++;
+    atomic_store_explicit(&ptst->count, cnt + 1, memory_order_relaxed);
     MB();
 #else
     gc_t *gc = ptst->gc;
-    int new_epoch, cnt;
+    unsigned int new_epoch;
  
  retry:
-    cnt = ptst->count++;
+    atomic_store_explicit(&ptst->count, cnt + 1, memory_order_relaxed);
     MB();
     if ( cnt == 1 )
     {
-        new_epoch = gc_global.current;
-        if ( gc->epoch != new_epoch )
+        /* Acquire pairs with the release in gc_reclaim(), for the
+         * chunks it moved to the allocation lists. */
+        new_epoch = atomic_load_explicit(&gc_global.current,
+                                         memory_order_acquire);
+        if ( atomic_load_explicit(&gc->epoch, memory_order_relaxed)
+             != new_epoch )
         {
-            gc->epoch = new_epoch;
+            atomic_store_explicit(&gc->epoch, new_epoch, memory_order_relaxed);
             gc->entries_since_reclaim        = 0;
 #ifdef YIELD_TO_HELP_PROGRESS
             gc->reclaim_attempts_since_yield = 0;
@@ -547,7 +590,7 @@ void gc_enter(ptst_t *ptst)
         }
         else if ( gc->entries_since_reclaim++ == 100 )
         {
-            ptst->count--;
+            atomic_store_explicit(&ptst->count, cnt, memory_order_release);
 #ifdef YIELD_TO_HELP_PROGRESS
             if ( gc->reclaim_attempts_since_yield++ == 10000 )
             {
@@ -564,10 +607,12 @@ void gc_enter(ptst_t *ptst)
 }
 
 
+/* Release, so that the critical section happens before any reclaim
+ * that sees the thread outside of it. */
 void gc_exit(ptst_t *ptst)
 {
-    MB();
-    ptst->count--;
+    unsigned int cnt = atomic_load_explicit(&ptst->count, memory_order_relaxed);
+    atomic_store_explicit(&ptst->count, cnt - 1, memory_order_release);
 }
 
 
@@ -606,11 +651,33 @@ gc_t *gc_init(void)
 
 int gc_add_allocator(unsigned int alloc_size)
 {
-    int ni, i = gc_global.nr_sizes;
-    while ( (ni = CASIO(&gc_global.nr_sizes, i, i+1)) != i ) i = ni;
+    return gc_add_arena_allocator(alloc_size, NULL);
+}
+
+
+int gc_add_arena_allocator(unsigned int alloc_size, arena_t *arena)
+{
+    int ni, i;
+
+    /* Blocks of equal size are interchangeable, share the allocator. */
+    for ( i = 0; i < gc_global.nr_sizes; i++ )
+        if ( gc_global.blk_sizes[i] == alloc_size &&
+             gc_global.arenas[i] == arena ) return i;
+
+    /* Slots are never given back; refuse once the table is full. */
+    for ( i = gc_global.nr_sizes; ; i = ni )
+    {
+        if ( i >= MAX_SIZES ) return -1;
+        if ( (ni = CASIO(&gc_global.nr_sizes, i, i+1)) == i ) break;
+    }
     gc_global.blk_sizes[i]  = alloc_size;
+    gc_global.arenas[i]     = arena;
     gc_global.alloc_size[i] = ALLOC_CHUNKS_PER_LIST;
-    gc_global.alloc[i] = get_filled_chunks(ALLOC_CHUNKS_PER_LIST, alloc_size);
+    atomic_store_explicit(&gc_global.heap_size[i], (unsigned long)
+                          ALLOC_CHUNKS_PER_LIST * BLKS_PER_CHUNK * alloc_size,
+                          memory_order_relaxed);
+    gc_global.alloc[i] = get_filled_chunks(ALLOC_CHUNKS_PER_LIST, alloc_size,
+                                           arena);
     return i;
 }
 
@@ -623,8 +690,16 @@ void gc_remove_allocator(int alloc_id)
 
 int gc_add_hook(hook_fn_t fn)
 {
-    int ni, i = gc_global.nr_hooks;
-    while ( (ni = CASIO(&gc_global.nr_hooks, i, i+1)) != i ) i = ni;
+    int ni, i;
+
+    for ( i = 0; i < gc_global.nr_hooks; i++ )
+        if ( gc_global.hook_fns[i] == fn ) return i;
+
+    for ( i = gc_global.nr_hooks; ; i = ni )
+    {
+        if ( i >= MAX_HOOKS ) return -1;
+        if ( (ni = CASIO(&gc_global.nr_hooks, i, i+1)) == i ) break;
+    }
     gc_global.hook_fns[i] = fn;
     return i;    
 }
@@ -636,10 +711,37 @@ void gc_remove_hook(int hook_id)
 }
 
 
+unsigned long gc_heap_size(void)
+{
+    return atomic_load_explicit(&gc_global.total_size, memory_order_relaxed);
+}
+
+
+int gc_nr_allocators(void)
+{
+    return gc_global.nr_sizes;
+}
+
+
+void gc_allocator_info(int alloc_id, unsigned int *blk_size,
+                       unsigned long *heap_size)
+{
+    *blk_size  = gc_global.blk_sizes[alloc_id];
+    *heap_size = atomic_load_explicit(&gc_global.heap_size[alloc_id],
+                                      memory_order_relaxed);
+}
+
+
+unsigned int gc_current_epoch(void)
+{
+    return atomic_load_explicit(&gc_global.current, memory_order_relaxed);
+}
+
+
 void _destroy_gc_subsystem(void)
 {
 #ifdef PROFILE_GC
-    printf("Total heap: %u bytes (%.2fMB) in %u allocations\n",
+    printf("Total heap: %lu bytes (%.2fMB) in %u allocations\n",
            gc_global.total_size, (double)gc_global.total_size / 1000000,
            gc_global.allocations);
 #endif
@@ -648,11 +750,21 @@ void _destroy_gc_subsystem(void)
 
 void _init_gc_subsystem(void)
 {
+    /*
+     * Threads keep their hook lists over a re-initialisation, filed by
+     * hook id, so the registered hooks are kept too. Otherwise pending
+     * pointers could later be passed to another hook given the id.
+     */
+    int nr_hooks = gc_global.nr_hooks;
+    hook_fn_t hook_fns[MAX_HOOKS];
+
+    memcpy(hook_fns, gc_global.hook_fns, sizeof(hook_fns));
     memset(&gc_global, 0, sizeof(gc_global));
 
     gc_global.page_size   = (unsigned int)sysconf(_SC_PAGESIZE);
     gc_global.free_chunks = alloc_more_chunks();
 
-    gc_global.nr_hooks = 0;
+    gc_global.nr_hooks = nr_hooks;
+    memcpy(gc_global.hook_fns, hook_fns, sizeof(hook_fns));
     gc_global.nr_sizes = 0;
 }
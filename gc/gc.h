@@ -9,7 +9,16 @@ typedef struct gc_st gc_t;
 /* Initialise GC section of given per-thread state structure. */
 gc_t *gc_init(void);
 
+/*
+ * Returns the allocator id, or -1 if the table of allocators is full.
+ * Allocators of equal block size (and arena) are shared, and ids are
+ * never released.
+ */
 int gc_add_allocator(unsigned int alloc_size);
+
+/* Allocator whose blocks are carved from @arena instead of the heap. */
+struct arena_st;
+int gc_add_arena_allocator(unsigned int alloc_size, struct arena_st *arena);
 void gc_remove_allocator(int alloc_id);
 
 /*
@@ -25,6 +34,7 @@ void gc_unsafe_free(ptst_t *ptst, void *p, int alloc_id);
  * lists.
  */
 typedef void (*hook_fn_t)(ptst_t *, void *);
+/* Returns the hook id, or -1 if the table of hooks is full. */
 int gc_add_hook(hook_fn_t fn);
 void gc_remove_hook(int hook_id);
 void gc_add_ptr_to_hook_list(ptst_t *ptst, void *ptr, int hook_id);
@@ -33,6 +43,15 @@ void gc_add_ptr_to_hook_list(ptst_t *ptst, void *ptr, int hook_id);
 void gc_enter(ptst_t *ptst);
 void gc_exit(ptst_t *ptst);
 
+/* Bytes of block memory taken from the heap so far. */
+unsigned long gc_heap_size(void);
+
+/* Introspection, for monitoring. Values may be slightly stale. */
+int gc_nr_allocators(void);
+void gc_allocator_info(int alloc_id, unsigned int *blk_size,
+                       unsigned long *heap_size);
+unsigned int gc_current_epoch(void);
+
 /* Start-of-day initialisation of garbage collector. */
 void _init_gc_subsystem(void);
 void _destroy_gc_subsystem(void);
@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include <sched.h>
+#include <stdatomic.h>
 
 #ifndef INTEL
 #define INTEL
@@ -19,38 +20,27 @@
  */
 
 /*
- * This is a strong barrier! Reads cannot be delayed beyond a later store.
- * Reads cannot be hoisted beyond a LOCK prefix. Stores always in-order.
+ * This is a strong barrier! The operations are sequentially
+ * consistent. The location need not be declared _Atomic, but must be
+ * naturally aligned and no larger than a pointer.
  */
-#define CAS(_a, _o, _n)                                    \
-({ __typeof__(_o) __o = _o;                                \
-   __asm__ __volatile__(                                   \
-       "lock cmpxchg %3,%1"                                \
-       : "=a" (__o), "=m" (*(volatile unsigned int *)(_a)) \
-       :  "0" (__o), "r" (_n) );                           \
-   __o;                                                    \
+#define CAS(_a, _o, _n)                                                   \
+({ __typeof__(*(_a)) __o = (_o);                                          \
+   atomic_compare_exchange_strong((_Atomic __typeof__(*(_a)) *)(_a),      \
+                                  &__o, (_n));                            \
+   __o;                                                                   \
 })
 
-#define FAS(_a, _n)                                        \
-({ __typeof__(_n) __o;                                     \
-   __asm__ __volatile__(                                   \
-       "lock xchg %0,%1"                                   \
-       : "=r" (__o), "=m" (*(volatile unsigned int *)(_a)) \
-       :  "0" (_n) );                                      \
-   __o;                                                    \
-})
+#define FAS(_a, _n)                                                       \
+    atomic_exchange((_Atomic __typeof__(*(_a)) *)(_a), (_n))
 
-#define CAS64(_a, _o, _n)                                        \
-({ __typeof__(_o) __o = _o;                                      \
-   __asm__ __volatile__(                                         \
-       "movl %3, %%ecx;"                                         \
-       "movl %4, %%ebx;"                                         \
-       "lock cmpxchg8b %1"                                       \
-       : "=A" (__o), "=m" (*(volatile unsigned long long *)(_a)) \
-       : "0" (__o), "m" (_n >> 32), "m" (_n)                     \
-       : "ebx", "ecx" );                                         \
-   __o;                                                          \
-})
+/* Loads and stores of locations that are concurrently CASed. */
+#define LOAD_ACQ(_a)                                                      \
+    atomic_load_explicit((_Atomic __typeof__(*(_a)) *)(_a),               \
+                         memory_order_acquire)
+#define STORE_RLX(_a, _n)                                                 \
+    atomic_store_explicit((_Atomic __typeof__(*(_a)) *)(_a), (_n),        \
+                          memory_order_relaxed)
 
 /* Update Integer location, return Old value. */
 #define CASIO CAS
@@ -60,7 +50,6 @@
 #define FASPO FAS
 /* Update 32/64-bit location, return Old value. */
 #define CAS32O CAS
-#define CAS64O CAS64
 
 /*
  * II. Memory barriers. 
@@ -72,15 +61,15 @@
  *  will!), then VOLATILE should be defined as 'volatile'.
  */
 
-#define MB()  __sync_synchronize()
-#define WMB() __asm__ __volatile__ ("" : : : "memory")
-#define RMB() MB()
+#define MB()  atomic_thread_fence(memory_order_seq_cst)
+#define WMB() atomic_thread_fence(memory_order_release)
+#define RMB() atomic_thread_fence(memory_order_acquire)
 #define VOLATILE /*volatile*/
 
-/* On Intel, CAS is a strong barrier, but not a compile barrier. */
-#define RMB_NEAR_CAS() WMB()
-#define WMB_NEAR_CAS() WMB()
-#define MB_NEAR_CAS()  WMB()
+/* CAS is sequentially consistent, and thus also a compiler barrier. */
+#define RMB_NEAR_CAS() ((void)0)
+#define WMB_NEAR_CAS() ((void)0)
+#define MB_NEAR_CAS()  ((void)0)
 
 
 /*
@@ -89,6 +78,7 @@
 
 typedef unsigned long long tick_t;
 
+#if defined(__x86_64__)
 static inline tick_t __attribute__((always_inline)) 
 RDTICK()
 { tick_t __t;
@@ -100,6 +90,14 @@ RDTICK()
 			 : "%rcx", "%rdx");
     return __t;
 }
+#elif defined(__aarch64__)
+static inline tick_t __attribute__((always_inline))
+RDTICK()
+{ tick_t __t;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(__t));
+    return __t;
+}
+#endif
 
 
 
@@ -35,7 +35,7 @@ typedef int bool_t;
 
 #define ADD_TO(_v,_x)                                                   \
 do {                                                                    \
-    int __val = (_v), __newval;                                         \
+    int __val = LOAD_ACQ(&(_v)), __newval;                              \
     while ( (__newval = CASIO(&(_v),__val,__val+(_x))) != __val )       \
         __val = __newval;                                               \
 } while ( 0 )
@@ -46,14 +46,14 @@
 #include "portable_defns.h"
 #include "ptst.h"
 
-ptst_t *ptst_list = NULL;
+ptst_t *_Atomic ptst_list = NULL;
 extern __thread ptst_t *ptst;
-static unsigned int next_id = 0;
+static _Atomic unsigned int next_id = 0;
 
 void
 critical_enter()
 {
-    ptst_t *next, *new_next;
+    ptst_t *next;
 
     if ( ptst == NULL ) 
     {
@@ -62,14 +62,17 @@ critical_enter()
 	    
 	memset(ptst, 0, sizeof(ptst_t));
 	ptst->gc = gc_init();
-	ptst->count = 1;
-	ptst->id = __sync_fetch_and_add(&next_id, 1);
+	atomic_init(&ptst->count, 1);
+	ptst->id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
 	rand_init(ptst);
-	new_next = ptst_list;
+	/* release publishes the initialised state to ptst_first() */
+	next = atomic_load_explicit(&ptst_list, memory_order_relaxed);
 	do {
-	    ptst->next = next = new_next;
-	} 
-	while ( (new_next = __sync_val_compare_and_swap(&ptst_list, next, ptst)) != next );
+	    ptst->next = next;
+	}
+	while ( !atomic_compare_exchange_weak_explicit(&ptst_list, &next, ptst,
+	                                               memory_order_release,
+	                                               memory_order_relaxed) );
     }
     
     gc_enter(ptst);
@@ -80,7 +83,7 @@ critical_enter()
 
 static void ptst_destructor(ptst_t *ptst) 
 {
-    ptst->count = 0;
+    atomic_store_explicit(&ptst->count, 0, memory_order_release);
 }
 
 
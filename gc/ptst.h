@@ -11,22 +11,33 @@
 #ifndef __PTST_H__
 #define __PTST_H__
 
+#include <stdatomic.h>
+
 typedef struct ptst_st ptst_t;
 
 #include "gc.h"
 
+/* Words of counters kept for the client of the thread state */
+#define PTST_COUNTERS 32
+
 struct ptst_st
 {
     /* Thread id */
     unsigned int id;
     /* State management */
     ptst_t      *next;
-    unsigned int count;
+    /* 1 when outside, > 1 inside a critical region */
+    _Atomic unsigned int count;
 
     /* Utility structures */
     gc_t        *gc;
     char pad[56];
     unsigned int rand;
+
+#ifdef PQ_STATS
+    /* Counters, written by the owner only, read by any thread */
+    _Atomic unsigned long counters[PTST_COUNTERS];
+#endif
 };
 
  /*
@@ -39,9 +50,9 @@ void critical_enter(void );
 #define critical_exit() gc_exit(ptst)
 
 /* Iterators */
-extern ptst_t *ptst_list;
+extern ptst_t *_Atomic ptst_list;
 
-#define ptst_first()  (ptst_list)
+#define ptst_first()  atomic_load_explicit(&ptst_list, memory_order_acquire)
 #define ptst_next(_p) ((_p)->next)
 
 
@@ -10,8 +10,9 @@
 
 typedef unsigned long rand_t;
 
+/* Must not be zero, the queue uses it for a xorshift generator. */
 #define rand_init(_ptst) \
-    ((_ptst)->rand = RDTICK())
+    ((_ptst)->rand = RDTICK() | 1)
 
 #define rand_next(_ptst) \
     ((_ptst)->rand = ((_ptst)->rand * 1103515245) + 12345)
@@ -0,0 +1,615 @@
+/**
+ * Component microbenchmarks.
+ *
+ * Measures the internal parts of the queue in isolation, on
+ * controlled skiplist shapes: the locate_preds() descent, the
+ * deletemin prefix walk, restructure(), gc_alloc()/gc_free() pairs,
+ * the effect of the skiplist branching factor, the compact index,
+ * fat node and radix index builds against the pointer build,
+ * inserts into a bounded queue, pq_clear() against destroying and
+ * recreating a queue, pq_meld() against moving the elements one by
+ * one, pq_split() against queue size, the executor against its
+ * number of workers, deletemin of relaxed queues against their block
+ * size, and inserts into buffered queues against their buffer size.
+ * All numbers are in cycles (rdtscp).
+ *
+ * The queue is compiled into this file, to reach its static
+ * functions.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <limits.h>
+
+#include "prioq.c"
+#include "prioq_idx.h"
+#include "prioq_fat.h"
+#include "prioq_radix.h"
+#include "executor.h"
+
+#define SEED 42
+#define DEFAULT_OFFSET 32
+#define DESCENTS 100000
+#define TRIALS 100
+#define MAX_LOG_SIZE 20
+#define MAX_LOG_PREFIX 12
+#define GC_PAIRS 1000000
+#define MAX_GC_THREADS 8
+#define BRANCHING_SIZE (1 << 18)
+#define INDEX_SIZE (1 << 18)
+#define INDEX_OPS 1000000
+#define INDEX_ARENA (1UL << 32)
+#define FAT_LOG_SIZE 20
+#define EXEC_BENCH_TASKS 1000000
+#define RELAXED_OPS (1 << 18)
+#define RADIX_LOG_SIZE 20
+#define RADIX_BUCKET_BITS 12
+#define BOUNDED_K 1024
+#define BOUNDED_LOG_OPS 24
+
+static unsigned short rng[3];
+
+static void
+fill(pq_t *pq, int n)
+{
+    for (int i = 0; i < n; i++) {
+        unsigned long k = 1 + nrand48(rng);
+        insert(pq, k, (pval_t) k);
+    }
+}
+
+
+/* Descent cost against queue size. */
+static void
+bench_locate_preds(void)
+{
+    node_t *preds[NUM_LEVELS], *succs[NUM_LEVELS];
+    pq_t *pq = pq_init(INT_MAX);
+    int size = 0;
+    uint64_t t;
+
+    printf("locate_preds\n%10s %10s\n", "size", "cycles/op");
+    for (int lg = 4; lg <= MAX_LOG_SIZE; lg += 2) {
+        fill(pq, (1 << lg) - size);
+        size = 1 << lg;
+
+        critical_enter();
+        t = read_tsc_p();
+        for (int i = 0; i < DESCENTS; i++)
+            locate_preds(pq, 1 + nrand48(rng), preds, succs);
+        t = read_tsc_p() - t;
+        critical_exit();
+
+        printf("%10d %10.1f\n", size, (double) t / DESCENTS);
+    }
+    pq_destroy(pq);
+}
+
+
+/* Deletemin prefix walk and restructure cost against deleted prefix
+ * length. Heads are never swung while building the prefix, since
+ * max_offset is huge. Afterwards, one deletemin with max_offset 0
+ * swings the heads and reclaims the prefix. */
+static void
+bench_prefix(void)
+{
+    pq_t *pq = pq_init(INT_MAX);
+    uint64_t walk, rs, t;
+
+    fill(pq, 1 << MAX_LOG_SIZE);
+    printf("deletemin prefix walk, restructure\n%10s %10s %10s\n",
+           "prefix", "walk", "restructure");
+    for (int lg = 0; lg <= MAX_LOG_PREFIX; lg += 2) {
+        int len = 1 << lg;
+        walk = rs = 0;
+        for (int i = 0; i < TRIALS; i++) {
+            for (int j = 0; j < len; j++)
+                deletemin(pq);
+
+            t = read_tsc_p();
+            deletemin(pq);
+            walk += read_tsc_p() - t;
+
+            critical_enter();
+            t = read_tsc_p();
+            restructure(pq);
+            rs += read_tsc_p() - t;
+            critical_exit();
+
+            pq->max_offset = 0;
+            deletemin(pq);
+            pq->max_offset = INT_MAX;
+            fill(pq, len + 2);
+        }
+        printf("%10d %10.1f %10.1f\n", len,
+               (double) walk / TRIALS, (double) rs / TRIALS);
+    }
+    pq_destroy(pq);
+}
+
+
+/* Memory per node and insert/deletemin cost against branching
+ * factor. */
+static void
+bench_branching(void)
+{
+    pq_shape_t sh;
+    uint64_t ins, del;
+    double bytes;
+
+    printf("branching\n%10s %10s %10s %10s\n", "1/p", "bytes/node",
+           "insert", "deletemin");
+    for (int b = 1; b <= 3; b++) {
+        pq_t *pq = pq_init_branching(DEFAULT_OFFSET, b);
+
+        ins = read_tsc_p();
+        fill(pq, BRANCHING_SIZE);
+        ins = read_tsc_p() - ins;
+
+        pq_shape_report(pq, &sh);
+        bytes = 0;
+        for (int l = 0; l < NUM_LEVELS; l++)
+            bytes += sh.level_hist[l] * (sizeof(node_t) + l * sizeof(node_t *));
+
+        del = read_tsc_p();
+        for (int i = 0; i < BRANCHING_SIZE / 2; i++)
+            deletemin(pq);
+        del = read_tsc_p() - del;
+
+        printf("%10d %10.1f %10.1f %10.1f\n", 1 << b, bytes / sh.live,
+               (double) ins / BRANCHING_SIZE, (double) del / (BRANCHING_SIZE / 2));
+        pq_destroy(pq);
+    }
+}
+
+
+static pq_t *index_pq;
+static pqi_t *index_pqi;
+static volatile int index_barrier, index_go;
+
+static void *
+index_ops(void *_res)
+{
+    unsigned short r[3];
+    uint64_t t;
+
+    rng_seed(r, SEED + *(uint64_t *)_res);
+    critical_enter();
+    critical_exit();
+    __sync_fetch_and_add(&index_barrier, 1);
+    while (!index_go) ;
+
+    t = read_tsc_p();
+    for (int i = 0; i < INDEX_OPS; i++) {
+        unsigned long k = 1 + nrand48(r);
+        if (index_pqi) {
+            if (i & 1) pqi_deletemin(index_pqi);
+            else pqi_insert(index_pqi, k, (pval_t) k);
+        } else {
+            if (i & 1) deletemin(index_pq);
+            else insert(index_pq, k, (pval_t) k);
+        }
+    }
+    *(uint64_t *)_res = read_tsc_p() - t;
+    return NULL;
+}
+
+
+/* Block bytes per node, and cycles per mixed insert/deletemin
+ * against thread count, of the pointer and the compact index build.
+ * Both builds draw levels from the same distribution, so the bytes
+ * are computed from the level histogram of the pointer build. */
+static void
+bench_index(void)
+{
+    pthread_t th[MAX_GC_THREADS];
+    uint64_t res[MAX_GC_THREADS], sum;
+    double bytes[2] = { 0, 0 };
+    pq_shape_t sh;
+
+    printf("pointer vs index build\n%10s %10s %10s %10s\n", "build",
+           "bytes/node", "threads", "cycles/op");
+    for (int b = 0; b < 2; b++) {
+        if (b) index_pqi = pqi_init(DEFAULT_OFFSET, INDEX_ARENA);
+        else   index_pq  = pq_init(DEFAULT_OFFSET);
+        for (int i = 0; i < INDEX_SIZE; i++) {
+            unsigned long k = 1 + nrand48(rng);
+            if (b) pqi_insert(index_pqi, k, (pval_t) k);
+            else   insert(index_pq, k, (pval_t) k);
+        }
+        if (!b) {
+            pq_shape_report(index_pq, &sh);
+            for (int l = 0; l < NUM_LEVELS; l++) {
+                bytes[0] += sh.level_hist[l] * (sizeof(node_t) + l * sizeof(node_t *));
+                bytes[1] += sh.level_hist[l] *
+                    ((offsetof(pqi_node_t, next) + (l + 1) * sizeof(pqi_ref_t) + 7) & ~7ul);
+            }
+        }
+
+        for (int n = 1; n <= MAX_GC_THREADS; n *= 2) {
+            index_barrier = index_go = 0;
+            for (int i = 0; i < n; i++) {
+                res[i] = i;
+                E_en(pthread_create(&th[i], NULL, index_ops, &res[i]));
+            }
+            while (index_barrier != n) ;
+            index_go = 1;
+            sum = 0;
+            for (int i = 0; i < n; i++) {
+                pthread_join(th[i], NULL);
+                sum += res[i];
+            }
+            printf("%10s %10.1f %10d %10.1f\n", b ? "index" : "pointer",
+                   bytes[b] / sh.live, n, (double) sum / n / INDEX_OPS);
+        }
+        if (b) pqi_destroy(index_pqi);
+        else   pq_destroy(index_pq);
+    }
+}
+
+
+/* Insert and deletemin cost against queue size, of the pointer and
+ * the fat node build. */
+static void
+bench_fat(void)
+{
+    uint64_t ins, del;
+
+    printf("pointer vs fat nodes\n%10s %10s %10s %10s\n", "build", "size",
+           "insert", "deletemin");
+    for (int b = 0; b < 2; b++) {
+        for (int lg = 12; lg <= FAT_LOG_SIZE; lg += 4) {
+            int n = 1 << lg;
+            pq_t *pq = NULL;
+            pqf_t *fpq = NULL;
+
+            if (b) fpq = pqf_init(DEFAULT_OFFSET);
+            else   pq  = pq_init(DEFAULT_OFFSET);
+
+            ins = read_tsc_p();
+            for (int i = 0; i < n; i++) {
+                unsigned long k = 1 + nrand48(rng);
+                if (b) pqf_insert(fpq, k, (pval_t) k);
+                else   insert(pq, k, (pval_t) k);
+            }
+            ins = read_tsc_p() - ins;
+
+            del = read_tsc_p();
+            for (int i = 0; i < n / 2; i++) {
+                if (b) pqf_deletemin(fpq);
+                else   deletemin(pq);
+            }
+            del = read_tsc_p() - del;
+
+            printf("%10s %10d %10.1f %10.1f\n", b ? "fat" : "pointer", n,
+                   (double) ins / n, (double) del / (n / 2));
+            if (b) pqf_destroy(fpq);
+            else   pq_destroy(pq);
+        }
+    }
+}
+
+
+/* Insert and deletemin cost against queue size, of the pointer and
+ * the radix index build. */
+static void
+bench_radix(void)
+{
+    uint64_t ins, del;
+
+    printf("pointer vs radix index\n%10s %10s %10s %10s\n", "build", "size",
+           "insert", "deletemin");
+    for (int b = 0; b < 2; b++) {
+        for (int lg = 12; lg <= RADIX_LOG_SIZE; lg += 4) {
+            int n = 1 << lg;
+            pq_t *pq = NULL;
+            pqr_t *rpq = NULL;
+
+            if (b) rpq = pqr_init(DEFAULT_OFFSET, RADIX_BUCKET_BITS);
+            else   pq  = pq_init(DEFAULT_OFFSET);
+
+            ins = read_tsc_p();
+            for (int i = 0; i < n; i++) {
+                unsigned long k = 1 + nrand48(rng);
+                if (b) pqr_insert(rpq, k, (pval_t) k);
+                else   insert(pq, k, (pval_t) k);
+            }
+            ins = read_tsc_p() - ins;
+
+            del = read_tsc_p();
+            for (int i = 0; i < n / 2; i++) {
+                if (b) pqr_deletemin(rpq);
+                else   deletemin(pq);
+            }
+            del = read_tsc_p() - del;
+
+            printf("%10s %10d %10.1f %10.1f\n", b ? "radix" : "pointer", n,
+                   (double) ins / n, (double) del / (n / 2));
+            if (b) pqr_destroy(rpq);
+            else   pq_destroy(pq);
+        }
+    }
+}
+
+
+/* Insert cost into a bounded queue against the number of keys
+ * streamed in so far. Most inserts are rejected once the queue is
+ * full. */
+static void
+bench_bounded(void)
+{
+    pq_t *pq = pq_init_bounded(DEFAULT_OFFSET, BOUNDED_K);
+    uint64_t t;
+    int done = 0;
+
+    printf("bounded queue, %d keys\n%10s %10s\n", BOUNDED_K, "inserts",
+           "insert");
+    for (int lg = 12; lg <= BOUNDED_LOG_OPS; lg += 4) {
+        int n = (1 << lg) - done;
+
+        t = read_tsc_p();
+        fill(pq, n);
+        t = read_tsc_p() - t;
+        done += n;
+
+        printf("%10d %10.1f\n", done, (double) t / n);
+    }
+    pq_destroy(pq);
+}
+
+
+/* Cost of emptying a queue, by pq_clear() and by pq_destroy() and
+ * pq_init(), against queue size. */
+static void
+bench_clear(void)
+{
+    uint64_t clr, des;
+    pq_t *pq;
+
+    printf("clear vs destroy\n%10s %10s %10s\n", "size", "clear",
+           "destroy");
+    for (int lg = 12; lg <= MAX_LOG_SIZE; lg += 4) {
+        pq = pq_init(DEFAULT_OFFSET);
+        fill(pq, 1 << lg);
+        clr = read_tsc_p();
+        pq_clear(pq);
+        clr = read_tsc_p() - clr;
+
+        fill(pq, 1 << lg);
+        des = read_tsc_p();
+        pq_destroy(pq);
+        pq = pq_init(DEFAULT_OFFSET);
+        des = read_tsc_p() - des;
+        pq_destroy(pq);
+
+        printf("%10d %10lu %10lu\n", 1 << lg, clr, des);
+    }
+}
+
+
+/* Moving a queue into another of the same size, per element. */
+static void
+bench_meld(void)
+{
+    uint64_t mld, mov;
+    pq_t *dst, *src;
+    pval_t v;
+    int n;
+
+    printf("meld vs deletemin+insert, per element\n%10s %10s %10s\n",
+           "size", "meld", "move");
+    for (int lg = 12; lg <= MAX_LOG_SIZE; lg += 4) {
+        n = 1 << lg;
+        dst = pq_init(DEFAULT_OFFSET);
+        src = pq_init(DEFAULT_OFFSET);
+        fill(dst, n);
+        fill(src, n);
+        mld = read_tsc_p();
+        pq_meld(dst, src);
+        mld = read_tsc_p() - mld;
+        pq_destroy(dst);
+
+        dst = pq_init(DEFAULT_OFFSET);
+        fill(dst, n);
+        fill(src, n);
+        mov = read_tsc_p();
+        while ((v = deletemin(src)) != NULL)
+            insert(dst, (pkey_t) v, v);
+        mov = read_tsc_p() - mov;
+        pq_destroy(dst);
+        pq_destroy(src);
+
+        printf("%10d %10lu %10lu\n", n, mld / n, mov / n);
+    }
+}
+
+
+/* Splitting a queue in the middle, against queue size. */
+static void
+bench_split(void)
+{
+    uint64_t t;
+    pq_t *pq, *hi;
+
+    printf("split\n%10s %10s\n", "size", "split");
+    for (int lg = 12; lg <= MAX_LOG_SIZE; lg += 4) {
+        pq = pq_init(DEFAULT_OFFSET);
+        fill(pq, 1 << lg);
+        t = read_tsc_p();
+        hi = pq_split(pq, 1UL << 30);
+        t = read_tsc_p() - t;
+        pq_destroy(hi);
+        pq_destroy(pq);
+
+        printf("%10d %10lu\n", 1 << lg, t);
+    }
+}
+
+
+static _Atomic long exec_ran;
+
+static void
+empty_task(void *arg)
+{
+    atomic_fetch_add_explicit(&exec_ran, 1, memory_order_relaxed);
+}
+
+/* Submitting and running empty tasks, per task. */
+static void
+bench_executor(void)
+{
+    uint64_t t;
+    exec_t *ex;
+
+    printf("executor, per task\n%10s %10s\n", "workers", "task");
+    for (int w = 1; w <= MAX_GC_THREADS; w *= 2) {
+        atomic_store(&exec_ran, 0);
+        ex = exec_init(w, 0);
+        t = read_tsc_p();
+        for (int i = 0; i < EXEC_BENCH_TASKS; i++)
+            exec_submit(ex, nrand48(rng), empty_task, NULL);
+        exec_shutdown(ex);
+        t = read_tsc_p() - t;
+        assert(exec_ran == EXEC_BENCH_TASKS);
+
+        printf("%10d %10lu\n", w, t / EXEC_BENCH_TASKS);
+    }
+}
+
+
+/* Deletemin from a relaxed queue, against block size; block 0 is
+ * the exact queue. */
+static void
+bench_relaxed(void)
+{
+    uint64_t t;
+    pq_t *pq;
+
+    printf("relaxed deletemin\n%10s %10s\n", "block", "deletemin");
+    for (int b = 0; b <= PQ_BLOCK_MAX; b = b ? 4 * b : 1) {
+        pq = b ? pq_init_relaxed(DEFAULT_OFFSET, b) : pq_init(DEFAULT_OFFSET);
+        fill(pq, 1 << MAX_LOG_SIZE);
+        t = read_tsc_p();
+        for (int i = 0; i < RELAXED_OPS; i++)
+            deletemin(pq);
+        t = read_tsc_p() - t;
+        pq_cache_flush(pq);
+        pq_destroy(pq);
+
+        printf("%10d %10lu\n", b, t / RELAXED_OPS);
+    }
+}
+
+
+/* Inserts into a buffered queue, against buffer size; size 0 is the
+ * plain queue. Random keys, and ascending keys above those. */
+static void
+bench_buffered(void)
+{
+    uint64_t r, a;
+    pq_t *pq;
+    int n = 1 << MAX_LOG_SIZE;
+
+    printf("buffered insert\n%10s %10s %10s\n", "buffer", "random",
+           "ascending");
+    for (int b = 0; b <= PQ_INSBUF_MAX; b = b ? 4 * b : 16) {
+        pq = b ? pq_init_buffered(DEFAULT_OFFSET, b) : pq_init(DEFAULT_OFFSET);
+        r = read_tsc_p();
+        fill(pq, n);
+        pq_insert_flush(pq);
+        r = read_tsc_p() - r;
+
+        a = read_tsc_p();
+        for (unsigned long i = 1; i <= n; i++)
+            insert(pq, (1UL << 32) + i, (pval_t) i);
+        pq_insert_flush(pq);
+        a = read_tsc_p() - a;
+        pq_destroy(pq);
+
+        printf("%10d %10lu %10lu\n", b, r / n, a / n);
+    }
+}
+
+
+static int gc_bench_id;
+static volatile int gc_barrier, gc_go;
+
+static void *
+gc_pairs(void *_res)
+{
+    uint64_t t;
+    void *p;
+
+    critical_enter();
+    critical_exit();
+    __sync_fetch_and_add(&gc_barrier, 1);
+    while (!gc_go) ;
+
+    t = read_tsc_p();
+    for (int i = 0; i < GC_PAIRS; i++) {
+        /* reenter now and then, so that garbage gets recycled */
+        if (i % 64 == 0) {
+            critical_exit();
+            critical_enter();
+        }
+        p = gc_alloc(ptst, gc_bench_id);
+        gc_free(ptst, p, gc_bench_id);
+    }
+    critical_exit();
+    *(uint64_t *)_res = read_tsc_p() - t;
+    return NULL;
+}
+
+
+/* Alloc/free pair cost against thread count. */
+static void
+bench_gc(void)
+{
+    pthread_t th[MAX_GC_THREADS];
+    uint64_t res[MAX_GC_THREADS], sum;
+
+    gc_bench_id = gc_add_allocator(sizeof(node_t));
+    printf("gc_alloc+gc_free\n%10s %10s\n", "threads", "cycles/pair");
+    for (int n = 1; n <= MAX_GC_THREADS; n *= 2) {
+        gc_barrier = gc_go = 0;
+        for (int i = 0; i < n; i++)
+            E_en(pthread_create(&th[i], NULL, gc_pairs, &res[i]));
+        while (gc_barrier != n) ;
+        gc_go = 1;
+        sum = 0;
+        for (int i = 0; i < n; i++) {
+            pthread_join(th[i], NULL);
+            sum += res[i];
+        }
+        printf("%10d %10.1f\n", n, (double) sum / n / GC_PAIRS);
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    rng_seed(rng, SEED);
+    _init_gc_subsystem();
+
+    bench_locate_preds();
+    bench_prefix();
+    bench_branching();
+    bench_gc();
+    bench_index();
+    bench_fat();
+    bench_radix();
+    bench_bounded();
+    bench_clear();
+    bench_meld();
+    bench_split();
+    bench_executor();
+    bench_relaxed();
+    bench_buffered();
+
+    _destroy_gc_subsystem();
+    return 0;
+}
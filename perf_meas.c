@@ -16,11 +16,15 @@
 #include <math.h>
 
 #include <limits.h>
+#include <signal.h>
 
 #include "gc/gc.h"
 
 #include "common.h"
 #include "prioq.h"
+#include "trace.h"
+#include "shmstats.h"
+#include "flight.h"
 
 /* check your cpu core numbering before pinning */
 #define PIN
@@ -30,6 +34,7 @@
 #define DEFAULT_OFFSET 32
 #define DEFAULT_SIZE 1<<15
 #define EXPS 100000000
+#define SAMPLE_USECS 10000
 
 #define THREAD_ARGS_FOREACH(_iter) \
     for (int i = 0; i < nthreads && (_iter = &ts[i]); i++)
@@ -44,16 +49,29 @@ void gen_exps(unsigned long *arr, unsigned short rng[3], int len, int intensity)
 /* the workloads */
 void work_exp (pq_t *pq);
 void work_uni (pq_t *pq);
+void work_pc (pq_t *pq);
 
 void *run (void *_args);
 
+/* trace replay */
+trace_stream_t prefill = { NULL, 0 };
+trace_stream_t *streams = NULL;
+double compression = 1.0;
+struct timespec replay_start;
+_Atomic int replay_done = 0;
+int replay (pq_t *pq, trace_stream_t *s);
+
 
 void (* work)(pq_t *pq);
 thread_args_t *ts;
 pq_t *pq;
 
-volatile int wait_barrier  = 0;
-volatile int loop  = 0;
+_Atomic int wait_barrier  = 0;
+_Atomic int loop  = 0;
+
+int pin_threads = 1;
+int latency = 0;
+int session_ops = 0;
 
 
 static void
@@ -74,15 +92,56 @@ usage(FILE *out, const char *argv0)
     fprintf(out, "\t-n NUM\t\tUse NUM threads. "
 	    "Default: %i\n",
 	    DEFAULT_NTHREADS);
+    fprintf(out, "\t-B OPS\t\tRun the operations in sessions of OPS operations, "
+	    "\n\t\t\tsee pq_session_begin().\n");
+    fprintf(out, "\t-b BITS\t\tUse a node level probability of 2^-BITS, "
+	    "\n\t\t\tBITS in 1..3. Default: 1\n");
     fprintf(out, "\t-s SIZE\t\tInitialize queue with SIZE elements. "
 	    "Default: %i\n",
 	    DEFAULT_SIZE);
+    fprintf(out, "\t-e\t\tUse the DES workload, exponentially distributed "
+	    "\n\t\t\tkeys, each thread doing deletemin followed by insert.\n");
+    fprintf(out, "\t-p\t\tUse the producer/consumer workload, even threads "
+	    "\n\t\t\tonly insert, odd threads only deletemin.\n");
+    fprintf(out, "\t-u\t\tDo not pin threads to cores, e.g., when "
+	    "\n\t\t\trunning more threads than cores.\n");
+    fprintf(out, "\t-l\t\tMeasure deletemin latency, deleted prefix "
+	    "\n\t\t\tlength and heap growth.\n");
+    fprintf(out, "\t-m NAME\t\tPublish statistics for pq_top in shared memory "
+	    "\n\t\t\tobject NAME, e.g., /pq.\n");
+    fprintf(out, "\t-F FILE\t\tDump the flight recorder to FILE on SIGUSR1 "
+	    "\n\t\t\tand at exit (needs a build with FLIGHT=true).\n");
+    fprintf(out, "\t-d\t\tPrint the shape of the queue after the run.\n");
+    fprintf(out, "\t-S SEED\t\tSeed the random number generators with SEED.\n");
+    fprintf(out, "\t-R FILE\t\tRecord an operation trace to FILE "
+	    "\n\t\t\t(needs a build with TRACE=true).\n");
+    fprintf(out, "\t-r FILE\t\tReplay the operation trace in FILE, with one "
+	    "\n\t\t\tthread per recorded thread, instead of running "
+	    "\n\t\t\ta workload.\n");
+    fprintf(out, "\t-c FACTOR\tCompress replay time by FACTOR, 0 replays "
+	    "\n\t\t\tas fast as possible. Default: 1\n");
+}
+
+
+/* Upper bound of the log2 bucket where the q-quantile falls. */
+static unsigned long
+lat_quantile(unsigned long *hist, unsigned long n, double q)
+{
+    unsigned long acc = 0;
+    if (n == 0)
+        return 0;
+    for (int b = 0; b < 64; b++) {
+        acc += hist[b];
+        if (acc >= q * n)
+            return 2UL << b;
+    }
+    return ~0UL;
 }
 
 
 
 static inline unsigned long
-next_geometric (unsigned short seed[3], unsigned int p)
+next_geometric (unsigned short seed[3], double p)
 {
     /* inverse transform sampling */
     /* cf. https://en.wikipedia.org/wiki/Geometric_distribution */
@@ -97,10 +156,10 @@ main (int argc, char **argv)
 {
     int opt;
     unsigned short rng[3];
-    struct timespec time;
     struct timespec start, end;
     thread_args_t *t;
     unsigned long elem;
+    unsigned long heap_start, plen, plen_max = 0, plen_sum = 0, samples = 0;
     
     extern char *optarg;
     extern int optind, optopt;
@@ -110,16 +169,35 @@ main (int argc, char **argv)
     int exp		= 0;
     int init_size	= DEFAULT_SIZE;
     int concise         = 0;
+    unsigned long seed  = 0;
+    char *record        = NULL;
+    char *replay_file   = NULL;
+    char *shm_name      = NULL;
+    char *flight_file   = NULL;
+    int shape           = 0;
+    int level_bits      = 1;
     work		= work_uni;
     
-    while ((opt = getopt(argc, argv, "t:n:o:s:hex")) >= 0) {
+    while ((opt = getopt(argc, argv, "t:n:o:s:hexpuldS:R:r:c:m:F:b:B:")) >= 0) {
         switch (opt) {
         case 'n': nthreads	= atoi(optarg); break;
         case 't': secs		= atoi(optarg); break;
         case 'o': offset	= atoi(optarg); break;
         case 's': init_size	= atoi(optarg); break;
         case 'x': concise       = 1; break;
+        case 'u': pin_threads   = 0; break;
+        case 'l': latency       = 1; break;
+        case 'S': seed          = strtoul(optarg, NULL, 0); break;
+        case 'R': record        = optarg; break;
+        case 'r': replay_file   = optarg; break;
+        case 'c': compression   = atof(optarg); break;
+        case 'm': shm_name      = optarg; break;
+        case 'F': flight_file   = optarg; break;
+        case 'd': shape         = 1; break;
+        case 'b': level_bits    = atoi(optarg); break;
+        case 'B': session_ops   = atoi(optarg); break;
         case 'e': exp		= 1; work = work_exp; break;
+        case 'p': work		= work_pc; break;
         case 'h': usage(stdout, argv[0]); exit(EXIT_SUCCESS); break;
         }
     }
@@ -128,20 +206,33 @@ main (int argc, char **argv)
     printf("Running without threads pinned to cores.\n");
 #endif
 
+    if (replay_file) {
+        if (trace_load(replay_file, &prefill, &streams, &nthreads) < 0)
+            exit(EXIT_FAILURE);
+        /* the trace has a prefill phase of its own */
+        init_size = 0;
+    }
+
     E_NULL(ts = malloc(nthreads*sizeof(thread_args_t)));
     memset(ts, 0, nthreads*sizeof(thread_args_t));
 
-    // finally available in macos 10.12 as well!
-    clock_gettime(CLOCK_REALTIME, &time);
-
     /* initialize seed */
-    rng[0] = time.tv_nsec;
-    rng[1] = time.tv_nsec >> 16;
-    rng[2] = time.tv_nsec >> 32;
+    if (seed)
+        rng_seed(rng, seed);
+    else
+        rng_init(rng);
 
     /* initialize garbage collection */
     _init_gc_subsystem();
-    pq = pq_init(offset);
+    pq = pq_init_branching(offset, level_bits);
+
+    if (record) {
+#ifndef TRACE
+        fprintf(stderr, "Not built with TRACE=true, trace will be empty.\n");
+#endif
+        if (trace_open(record) < 0)
+            exit(EXIT_FAILURE);
+    }
 
     // if DES workload, pre-sample values/event times
     if (exp) {
@@ -159,12 +250,32 @@ main (int argc, char **argv)
             insert(pq, elem, (void *)elem);
         }
     }
+    /* or replay the prefill phase, before any thread starts */
+    for (size_t i = 0; i < prefill.len; i++) {
+        if (prefill.recs[i].op == TRACE_INSERT)
+            insert(pq, prefill.recs[i].k, (pval_t) prefill.recs[i].k);
+        else
+            deletemin(pq);
+    }
+    if (record)
+        trace_run();
+
 
+    heap_start = gc_heap_size();
+
+    if (shm_name && pq_shm_publish(shm_name) < 0)
+        exit(EXIT_FAILURE);
+
+    if (flight_file)
+        flight_dump_on_signal(SIGUSR1, flight_file);
 
     /* initialize threads */
     THREAD_ARGS_FOREACH(t) {
         t->id = i;
-        rng_init(t->rng);
+        if (seed)
+            rng_seed(t->rng, seed + i + 1);
+        else
+            rng_init(t->rng);
         E_en(pthread_create(&t->thread, NULL, run, t));
     }
 
@@ -174,11 +285,26 @@ main (int argc, char **argv)
     while (wait_barrier != nthreads) ;
     IRMB();
     gettime(&start);
+    replay_start = start;
     loop = 1;
     IWMB();
     /* Process might sleep longer than specified,
      * but this will be accounted for. */
-    usleep( 1000000 * secs );
+    if (streams || latency) {
+        /* a replay runs until all streams are done */
+        for (long us = 0; streams ? replay_done != nthreads
+                 : us < 1000000L * secs; us += SAMPLE_USECS) {
+            usleep(SAMPLE_USECS);
+            if (!latency) continue;
+            /* sample the deleted prefix while running */
+            plen = pq_prefix_length(pq);
+            plen_max = max(plen_max, plen);
+            plen_sum += plen;
+            samples++;
+        }
+    } else {
+        usleep( 1000000 * secs );
+    }
     loop = 0; /* halt all threads */
     IWMB();
     gettime(&end);
@@ -209,10 +335,75 @@ main (int argc, char **argv)
         printf("Max ops/t:\t%d\n", max);
     } else {
         printf("%li\n", lround((double) sum / dt));
-        
+    }
+
+    if (latency) {
+        unsigned long hist[64] = {0}, n = 0;
+        THREAD_ARGS_FOREACH(t) {
+            for (int b = 0; b < 64; b++) {
+                hist[b] += t->lat[b];
+                n += t->lat[b];
+            }
+        }
+        if (!concise) {
+            printf("Prefix len:\t%.1f avg, %lu max\n",
+                   samples ? (double) plen_sum / samples : 0.0, plen_max);
+            printf("Heap growth:\t%lu bytes\n", gc_heap_size() - heap_start);
+            printf("Deletemin:\tp50 < %lu, p99 < %lu, p99.9 < %lu cycles\n",
+                   lat_quantile(hist, n, 0.5), lat_quantile(hist, n, 0.99),
+                   lat_quantile(hist, n, 0.999));
+        } else {
+            printf("%.1f %lu %lu %lu %lu %lu\n",
+                   samples ? (double) plen_sum / samples : 0.0, plen_max,
+                   gc_heap_size() - heap_start,
+                   lat_quantile(hist, n, 0.5), lat_quantile(hist, n, 0.99),
+                   lat_quantile(hist, n, 0.999));
+        }
     }
     
+#ifdef PQ_STATS
+    if (!concise) {
+        pq_stats_t st;
+        pq_stats_snapshot(&st);
+        printf("Inserts:\t%lu, %lu bottom retries, %lu upper retries, "
+               "%lu duplicates\n", st.inserts, st.insert_retries,
+               st.insert_retries_upper, st.duplicates);
+        printf("Deletemins:\t%lu, %lu empty\n", st.deletemins, st.empty);
+        printf("Offsets:\t");
+        for (int b = 0; b < STATS_OFFSET_BUCKETS; b++)
+            printf("%lu ", st.offset_hist[b]);
+        printf("\n");
+        printf("Head swings:\t%lu/%lu, %.1f nodes freed/swing, "
+               "%lu restructure iterations\n", st.swing_wins,
+               st.swing_attempts, st.swing_wins ?
+               (double) st.nodes_freed / st.swing_wins : 0.0,
+               st.restructure_iters);
+    }
+#endif
+
+    if (flight_file) {
+        /* not through the signal, whose thread could still be dumping
+         * at exit */
+        FILE *f = fopen(flight_file, "w");
+        if (f) {
+            flight_dump(f);
+            fclose(f);
+        }
+    }
+
+    if (shape) {
+        pq_shape_t s;
+        pq_shape_report(pq, &s);
+        pq_shape_print(stdout, &s);
+    }
+
     /* CLEANUP */
+    if (shm_name)
+        pq_shm_unpublish();
+    if (record)
+        trace_close();
+    if (streams)
+        trace_free(&prefill, streams, nthreads);
     pq_destroy(pq);
     free (ts);
     _destroy_gc_subsystem();
@@ -221,6 +412,20 @@ main (int argc, char **argv)
 
 __thread thread_args_t *args; 
 
+static inline void
+timed_deletemin(pq_t *pq)
+{
+    uint64_t t0;
+
+    if (!latency) {
+        deletemin(pq);
+        return;
+    }
+    t0 = read_tsc_p();
+    deletemin(pq);
+    args->lat[63 - __builtin_clzl((read_tsc_p() - t0) | 1)]++;
+}
+
 /* uniform workload */
 void
 work_uni (pq_t *pq)  
@@ -231,7 +436,20 @@ work_uni (pq_t *pq)
         elem = (unsigned long)1 + nrand48(args->rng);
         insert(pq, elem, (void *)elem);
     } else 
-        deletemin(pq);
+        timed_deletemin(pq);
+}
+
+/* producer/consumer workload */
+void
+work_pc (pq_t *pq)
+{
+    unsigned long elem;
+
+    if (args->id % 2 == 0) {
+        elem = (unsigned long)1 + nrand48(args->rng);
+        insert(pq, elem, (void *)elem);
+    } else
+        timed_deletemin(pq);
 }
 
 /* DES workload */
@@ -240,7 +458,7 @@ work_exp (pq_t *pq)
 {
     int pos;
     unsigned long elem;
-    deletemin(pq);
+    timed_deletemin(pq);
     pos = __sync_fetch_and_add(&exps_pos, 1);
     elem = exps[pos];
     insert(pq, elem, (void *)elem);
@@ -257,19 +475,32 @@ run (void *_args)
 #if defined(PIN) && defined(__linux__)
     /* Straight allocation on 32 core machine.
      * Check with your OS + machine.  */
-    pin (gettid(), args->id/8 + 4*(args->id % 8));
+    if (pin_threads)
+        pin (gettid(), args->id/8 + 4*(args->id % 8));
 #endif
 
     // call in to main thread
-    __sync_fetch_and_add(&wait_barrier, 1);
+    atomic_fetch_add(&wait_barrier, 1);
 
     // wait until signaled by main thread
     while (!loop);
     /* start benchmark execution */
-    do {
-	work(pq);
-        cnt++;
-    } while (loop);
+    if (streams) {
+        cnt = replay(pq, &streams[args->id]);
+        atomic_fetch_add(&replay_done, 1);
+    } else {
+        do {
+            if (session_ops) {
+                pq_session_begin();
+                for (int i = 0; i < session_ops && loop; i++, cnt++)
+                    work(pq);
+                pq_session_end();
+            } else {
+                work(pq);
+                cnt++;
+            }
+        } while (loop);
+    }
     /* end of measured execution */
 
     args->measure = cnt;
@@ -277,6 +508,34 @@ run (void *_args)
 }
 
 
+/* Replay a recorded stream. Each operation is issued no earlier than
+ * its recorded time divided by the compression factor. The order
+ * between streams is not enforced. */
+int
+replay (pq_t *pq, trace_stream_t *s)
+{
+    struct timespec now;
+    double due, elapsed;
+
+    for (size_t i = 0; i < s->len; i++) {
+        trace_rec_t *r = &s->recs[i];
+        if (compression > 0) {
+            due = r->t / compression;
+            do {
+                gettime(&now);
+                now = timediff(replay_start, now);
+                elapsed = now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+            } while (elapsed < due);
+        }
+        if (r->op == TRACE_INSERT)
+            insert(pq, r->k, (pval_t) r->k);
+        else
+            timed_deletemin(pq);
+    }
+    return s->len;
+}
+
+
 /* generate array of exponentially distributed variables */
 void
 gen_exps(unsigned long *arr, unsigned short rng[3], int len, int intensity)
@@ -285,7 +544,7 @@ gen_exps(unsigned long *arr, unsigned short rng[3], int len, int intensity)
     arr[0] = 2;
     while (++i < len)
 	arr[i] = arr[i-1] + 
-	    next_geometric(rng, intensity);
+	    next_geometric(rng, 1.0 / intensity);
 }
 
 
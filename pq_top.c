@@ -0,0 +1,168 @@
+/**
+ * pq_top, watch the statistics a queue process publishes with
+ * pq_shm_publish(). Needs a build with STATS=true for the operation
+ * counters.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "shmstats.h"
+
+#define DEFAULT_NAME "/pq"
+#define DEFAULT_SECS 1
+
+static volatile int stop = 0;
+
+static void
+on_signal(int sig)
+{
+    stop = 1;
+}
+
+
+static void
+usage(FILE *out, const char *argv0)
+{
+    fprintf(out, "Usage: %s [OPTION]...\n"
+	    "\n"
+	    "Options:\n", argv0);
+    fprintf(out, "\t-h\t\tDisplay usage.\n");
+    fprintf(out, "\t-m NAME\t\tAttach to shared memory object NAME. "
+	    "Default: %s\n", DEFAULT_NAME);
+    fprintf(out, "\t-d SECS\t\tRefresh every SECS seconds. "
+	    "Default: %i\n", DEFAULT_SECS);
+    fprintf(out, "\t-c COUNT\tExit after COUNT refreshes.\n");
+}
+
+
+/* Seqlock read. */
+static void
+shm_read(pq_shm_t *shm, pq_shm_t *copy)
+{
+    uint32_t seq;
+    do {
+        while ((seq = shm->seq) & 1) ;
+        IRMB();
+        memcpy(copy, shm, sizeof *copy);
+        IRMB();
+    } while (shm->seq != seq);
+}
+
+
+static void
+sum(pq_shm_t *s, pq_stats_t *t)
+{
+    unsigned long *d = (unsigned long *)t;
+    memset(t, 0, sizeof *t);
+    for (int i = 0; i < s->nthreads; i++) {
+        unsigned long *c = (unsigned long *)&s->threads[i];
+        for (size_t j = 0; j < sizeof *t / sizeof *d; j++)
+            d[j] += c[j];
+    }
+}
+
+
+#define RATE(_f) ((cur._f - old._f) / dt)
+
+static void
+show(pq_shm_t *now, pq_shm_t *prev)
+{
+    pq_stats_t cur, old;
+    double dt = (now->time_ns - prev->time_ns) / 1e9;
+    unsigned long heap = 0;
+
+    if (dt <= 0) return;
+    sum(now, &cur);
+    sum(prev, &old);
+
+    printf("\033[H\033[J");
+    printf("epoch %u  threads %u  length ~%lu (all queues)\n\n",
+           now->epoch, now->nthreads, (unsigned long) now->length);
+    printf("%12s %12s %12s %12s %12s %12s %12s\n", "insert/s", "delmin/s",
+           "retry/s", "dup/s", "empty/s", "swing/s", "freed/s");
+    printf("%12.0f %12.0f %12.0f %12.0f %12.0f %12.0f %12.0f\n\n",
+           RATE(inserts), RATE(deletemins),
+           RATE(insert_retries) + RATE(insert_retries_upper),
+           RATE(duplicates), RATE(empty), RATE(swing_wins),
+           RATE(nodes_freed));
+
+    printf("%8s %12s %12s\n", "thread", "insert/s", "delmin/s");
+    for (int i = 0; i < now->nthreads && i < prev->nthreads; i++) {
+        printf("%8d %12.0f %12.0f\n", i,
+               (now->threads[i].inserts - prev->threads[i].inserts) / dt,
+               (now->threads[i].deletemins - prev->threads[i].deletemins) / dt);
+    }
+
+    printf("\n%8s %12s\n", "block", "heap");
+    for (int i = 0; i < now->npools; i++) {
+        heap += now->pools[i].heap_size;
+        if (now->pools[i].heap_size)
+            printf("%8u %12lu\n", now->pools[i].blk_size,
+                   now->pools[i].heap_size);
+    }
+    printf("%8s %12lu\n", "total", heap);
+    fflush(stdout);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    const char *name = DEFAULT_NAME;
+    int secs = DEFAULT_SECS, count = -1, opt, fd;
+    pq_shm_t *shm, *now, *prev, *tmp;
+
+    while ((opt = getopt(argc, argv, "m:d:c:h")) >= 0) {
+        switch (opt) {
+        case 'm': name  = optarg; break;
+        case 'd': secs  = atoi(optarg); break;
+        case 'c': count = atoi(optarg); break;
+        case 'h': usage(stdout, argv[0]); exit(EXIT_SUCCESS); break;
+        default:  usage(stderr, argv[0]); exit(EXIT_FAILURE); break;
+        }
+    }
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    shm = mmap(NULL, sizeof *shm, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED || shm->magic != SHM_MAGIC ||
+        shm->version != SHM_VERSION) {
+        fprintf(stderr, "%s: not a queue statistics object\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    E_NULL(now = malloc(sizeof *now));
+    E_NULL(prev = malloc(sizeof *prev));
+
+    /* the lease makes the publisher start collecting, and lapses if
+     * pq_top is killed */
+    pq_shm_renew(shm, 2 * SHM_PERIOD_US);
+    usleep(2 * SHM_PERIOD_US);
+    shm_read(shm, prev);
+
+    while (!stop && count--) {
+        pq_shm_renew(shm, secs * 1000000UL);
+        sleep(secs);
+        shm_read(shm, now);
+        show(now, prev);
+        tmp = prev; prev = now; now = tmp;
+    }
+
+    munmap(shm, sizeof *shm);
+    free(now);
+    free(prev);
+    return 0;
+}
@@ -40,8 +40,12 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <assert.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
 /* keir fraser's garbage collection */
 #include "gc/ptst.h"
@@ -52,39 +56,197 @@
 /* interface, constant defines, and typedefs */
 #include "prioq.h"
 
+/* flight recorder events */
+#include "flight.h"
+
+#ifdef TRACE
+#include "trace.h"
+#define trace(_op, _k) trace_record(_op, _k)
+#else
+#define trace(_op, _k) ((void)(_k))
+#endif
+
 
 /* thread state. */
 __thread ptst_t *ptst;
 
 static int gc_id[NUM_LEVELS];
+static int clear_hook_id;
+
+/* Software prefetching of the next node of a walk, see the Makefile.
+ * The key and inserting flag share the node's first line, next[i] may
+ * be on the following one. Prefetches do not fault, so the NULL next
+ * pointers of the tail need no test. */
+#ifdef PQ_PREFETCH
+#define prefetch_node(_n, _i)                                   \
+    do {                                                        \
+        node_t *_p = (_n);                                      \
+        __builtin_prefetch(&_p->k);                             \
+        __builtin_prefetch(&_p->next[_i]);                      \
+    } while (0)
+#else
+#define prefetch_node(_n, _i) ((void)0)
+#endif
+
+#ifdef INSERT_DELAY
+/* Fault injection. Stall the inserting thread for INSERT_DELAY us
+ * after the bottom level CAS, while the inserting flag is still set,
+ * once every INSERT_DELAY_PERIOD inserts. */
+#ifndef INSERT_DELAY_PERIOD
+#define INSERT_DELAY_PERIOD 1024
+#endif
+static __thread unsigned int insert_cnt;
+#define insert_delay()                                  \
+    do {                                                \
+        if (++insert_cnt % INSERT_DELAY_PERIOD == 0)    \
+            usleep(INSERT_DELAY);                       \
+    } while (0)
+#else
+#define insert_delay() ((void)0)
+#endif
+
+
+/* Next pointer and flag accesses. A node's fields are published by
+ * the release CAS that links it in at the bottom level, and seen
+ * through the acquire loads of a traversal. Checking a mark alone
+ * needs no ordering. C11 has no fetch_or on pointers, so marking goes
+ * through an integer of the same representation. */
+#define get_next(_n, _i)                                                \
+    atomic_load_explicit(&(_n)->next[_i], memory_order_acquire)
+#define get_next_rlx(_n, _i)                                            \
+    atomic_load_explicit(&(_n)->next[_i], memory_order_relaxed)
+#define set_next(_n, _i, _v)                                            \
+    atomic_store_explicit(&(_n)->next[_i], (_v), memory_order_relaxed)
+#define cas_next(_n, _i, _o, _v, _mo)                                   \
+    ({ node_t *__o = (_o);                                              \
+       atomic_compare_exchange_strong_explicit(&(_n)->next[_i], &__o,   \
+           (_v), (_mo), memory_order_relaxed); })
+#define mark_next(_n)                                                   \
+    ((node_t *) atomic_fetch_or_explicit(                               \
+        (_Atomic uintptr_t *)&(_n)->next[0], 1, memory_order_acq_rel))
+#define get_inserting(_n)                                               \
+    atomic_load_explicit(&(_n)->inserting, memory_order_acquire)
+#define get_head(_pq)                                                   \
+    atomic_load_explicit(&(_pq)->head, memory_order_acquire)
+#define clear_inserting(_n)                                             \
+    atomic_store_explicit(&(_n)->inserting, 0, memory_order_release)
+
+
+/***** sessions *****
+ * A session keeps the thread in one GC critical section across
+ * operations. Every PQ_SESSION_OPS operations it is left and entered
+ * again, so that the epoch can still move on.
+ */
+static __thread int session_depth;
+static __thread unsigned int session_ops;
+
+void
+pq_session_begin(void)
+{
+    if (session_depth++ == 0) {
+        critical_enter();
+        session_ops = 0;
+    }
+}
 
+void
+pq_session_end(void)
+{
+    assert(session_depth > 0);
+    if (--session_depth == 0)
+        critical_exit();
+}
+
+static inline void
+op_enter(void)
+{
+    if (!session_depth) {
+        critical_enter();
+    } else if (++session_ops == PQ_SESSION_OPS) {
+        session_ops = 0;
+        critical_exit();
+        critical_enter();
+    }
+}
+
+static inline void
+op_exit(void)
+{
+    if (!session_depth)
+        critical_exit();
+}
+
+
+/* random node level */
+static inline int
+random_level(pq_t *pq)
+{
+    /* xorshift32 rng, all bits usable */
+    unsigned int r = ptst->rand;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    ptst->rand = r;
+    /* uniformly distributed bits => geom. dist. level,
+     * p = 2^-level_bits */
+    int level = __builtin_ctz(r | (1u << (NUM_LEVELS - 1))) / pq->level_bits + 1;
+    assert(1 <= level && level <= 32);
+    return level;
+}
 
 /* initialize new node */
 static node_t *
-alloc_node()
+alloc_node(pq_t *pq)
 {
     node_t *n;
-    /* crappy lcg rng */
-    unsigned int r = ptst->rand;
-    ptst->rand = r * 1103515245 + 12345;
-    r &= (1u << (NUM_LEVELS - 1)) - 1;
-    /* uniformly distributed bits => geom. dist. level, p = 0.5 */
-    int level = __builtin_ctz(r) + 1;
-    assert(1 <= level && level <= 32);
+    int level = random_level(pq);
 
     n = gc_alloc(ptst, gc_id[level - 1]);
     n->level = level;
-    n->inserting = 1;
+    /* A level 1 node is complete as soon as it is linked in at the
+     * bottom level, so it never needs to hold back deletemin. */
+    atomic_init(&n->inserting, level > 1);
     memset(n->next, 0, level * sizeof(node_t *));
     return n;
 }
 
 
-/* Mark node as ready for reclamation to the garbage collector. */
+/* Mark node as ready for reclamation to the garbage collector. The
+ * links of an intrusive queue are instead handed back to their owner,
+ * through the reuse callback, once no thread can see them. */
 static void 
-free_node(node_t *n)
+free_node(pq_t *pq, node_t *n)
+{
+    if (pq->reuse)
+        gc_add_ptr_to_hook_list(ptst, (void *)n, pq->hook_id);
+    else
+        gc_free(ptst, (void *)n, gc_id[(n->level) - 1]);
+}
+
+/* GC hook of intrusive queues, the value of a link is the callback. */
+static void
+link_reclaimed(ptst_t *p, void *ptr)
 {
-    gc_free(ptst, (void *)n, gc_id[(n->level) - 1]);
+    node_t *n = ptr;
+    ((pq_reuse_fn_t) n->v)((pq_link_t *)n);
+}
+
+/* GC hook of pq_clear(), reclaims a replaced head and the nodes it
+ * leads to. No thread can see them anymore, so they go straight back
+ * to the allocator. The value of a head is the tail, which may be
+ * gone by now, if the queue has been destroyed. */
+static void
+chain_reclaimed(ptst_t *p, void *ptr)
+{
+    node_t *x, *nxt, *h = ptr;
+
+    x = get_unmarked_ref(get_next_rlx(h, 0));
+    while (x != (node_t *) h->v) {
+        nxt = get_unmarked_ref(get_next_rlx(x, 0));
+        gc_unsafe_free(p, (void *)x, gc_id[x->level - 1]);
+        x = nxt;
+    }
+    free(h);
 }
 
 
@@ -120,26 +282,30 @@ locate_preds(pq_t * restrict pq, pkey_t k, node_t ** restrict preds, node_t ** r
     node_t *x, *x_next, *del = NULL;
     int d = 0, i;
 
-    x = pq->head;
+    x = get_head(pq);
     i = NUM_LEVELS - 1;
     while (i >= 0)
     {
-        x_next = x->next[i];
+        x_next = get_next(x, i);
         d = is_marked_ref(x_next);
         x_next = get_unmarked_ref(x_next);
         assert(x_next != NULL);
 	
-        while (x_next->k < k || is_marked_ref(x_next->next[0])
+        /* the node after x_next is two hops ahead, its pointer is on
+         * the line of x_next that the loop test loads anyway */
+        prefetch_node(get_unmarked_ref(get_next_rlx(x_next, i)), i);
+        while (x_next->k < k || is_marked_ref(get_next_rlx(x_next, 0))
                || ((i == 0) && d)) {
             /* Record bottom level deleted node not having delete flag
              * set, if traversed. */
             if (i == 0 && d)
                 del = x_next;
             x = x_next;
-            x_next = x->next[i];
+            x_next = get_next(x, i);
             d = is_marked_ref(x_next);
             x_next = get_unmarked_ref(x_next);
             assert(x_next != NULL);
+            prefetch_node(get_unmarked_ref(get_next_rlx(x_next, i)), i);
         }
         preds[i] = x;
         succs[i] = x_next;
@@ -157,20 +323,16 @@ locate_preds(pq_t * restrict pq, pkey_t k, node_t ** restrict preds, node_t ** r
  * recorded, after which the node n is inserted from bottom to
  * top. Conditioned on that succs[i] is still the successor of
  * preds[i], n will be spliced in on level i.
+ *
+ * insert_node links in an initialised node, and must be called within
+ * a critical section. Returns 0 if the key was already present.
  */
-void 
-insert(pq_t *pq, pkey_t k, pval_t v)
+static int
+insert_node(pq_t *pq, node_t *new)
 {
     node_t *preds[NUM_LEVELS], *succs[NUM_LEVELS];
-    node_t *new = NULL, *del = NULL;
-    
-    assert(SENTINEL_KEYMIN < k && k < SENTINEL_KEYMAX);
-    critical_enter();
-    
-    /* Initialise a new node for insertion. */
-    new    = alloc_node();
-    new->k = k;
-    new->v = v;
+    node_t *del = NULL;
+    pkey_t k = new->k;
 
     /* lowest level insertion retry loop */
  retry:
@@ -178,22 +340,25 @@ insert(pq_t *pq, pkey_t k, pval_t v)
 
     /* return if key already exists, i.e., is present in a non-deleted
      * node */
-    if (succs[0]->k == k && !is_marked_ref(preds[0]->next[0]) && preds[0]->next[0] == succs[0]) {
-        new->inserting = 0;
-        free_node(new);
-        goto out;
+    if (succs[0]->k == k && get_next(preds[0], 0) == succs[0]) {
+        clear_inserting(new);
+        STAT_INC(duplicates);
+        return 0;
     }
-    new->next[0] = succs[0];
+    set_next(new, 0, succs[0]);
 
     /* The node is logically inserted once it is present at the bottom
      * level. */
-    if (!__sync_bool_compare_and_swap(&preds[0]->next[0], succs[0], new)) {
+    if (!cas_next(preds[0], 0, succs[0], new, memory_order_release)) {
         /* either succ has been deleted (modifying preds[0]),
          * or another insert has succeeded or preds[0] is head,
          * and a restructure operation has updated it */
+        STAT_INC(insert_retries);
         goto retry;
     }
 
+    insert_delay();
+
     /* Insert at each of the other levels in turn. */
     int i = 1;
     while ( i < new->level)
@@ -202,16 +367,17 @@ insert(pq_t *pq, pkey_t k, pval_t v)
          * only new is deleted as well, but this we can't tell) If a
          * candidate successor at any level is deleted, we consider
          * the operation completed. */
-        if (is_marked_ref(new->next[0]) ||
-            is_marked_ref(succs[i]->next[0]) ||
+        if (is_marked_ref(get_next_rlx(new, 0)) ||
+            is_marked_ref(get_next_rlx(succs[i], 0)) ||
             del == succs[i])
             goto success;
 
         /* prepare next pointer of new node */
-        new->next[i] = succs[i];
-        if (!__sync_bool_compare_and_swap(&preds[i]->next[i], succs[i], new))
+        set_next(new, i, succs[i]);
+        if (!cas_next(preds[i], i, succs[i], new, memory_order_release))
         {
             /* failed due to competing insert or restructure */
+            STAT_INC(insert_retries_upper);
             del = locate_preds(pq, k, preds, succs);
 
             /* if new has been deleted, we're done */
@@ -223,13 +389,418 @@ insert(pq_t *pq, pkey_t k, pval_t v)
         }
     }
  success:
-    if (new) {
-        /* this flag must be reset *after* all CAS have completed */
-        new->inserting = 0;
-    }
+    /* this flag must be reset *after* all CAS have completed */
+    clear_inserting(new);
+    return 1;
+}
+
+/* The _nogc variants must be called within a critical section. */
+static int
+insert_nogc(pq_t *pq, pkey_t k, pval_t v)
+{
+    node_t *new;
+
+    STAT_INC(inserts);
     
- out:
-    critical_exit();
+    /* Initialise a new node for insertion. */
+    new    = alloc_node(pq);
+    new->k = k;
+    new->v = v;
+
+    if (!insert_node(pq, new)) {
+        free_node(pq, new);
+        return 0;
+    }
+    return 1;
+}
+
+
+/***** bounded queues *****
+ *
+ * A bounded queue counts its live nodes, approximately, and caches
+ * the key of its bound-th node as a threshold. Once it holds
+ * trim_limit() nodes, the nodes after the bound-th are cut off.
+ *
+ * The trim is not lock-free. Cutting the list in the middle would
+ * break the invariant that the deleted nodes form a prefix, on which
+ * locate_preds() and deletemin rely, so the trimming thread waits
+ * until no other operation is in progress on the queue, and holds
+ * new ones back at the gate meanwhile. Rejected inserts never pass
+ * the gate.
+ */
+#define GATE_TRIM (1UL << 63)
+
+static inline void
+gate_enter(pq_t *pq)
+{
+    while (atomic_fetch_add_explicit(&pq->gate, 1, memory_order_acq_rel)
+           & GATE_TRIM) {
+        atomic_fetch_sub_explicit(&pq->gate, 1, memory_order_relaxed);
+        while (atomic_load_explicit(&pq->gate, memory_order_acquire)
+               & GATE_TRIM) ;
+    }
+}
+
+static inline void
+gate_exit(pq_t *pq)
+{
+    atomic_fetch_sub_explicit(&pq->gate, 1, memory_order_release);
+}
+
+static inline long
+trim_limit(pq_t *pq)
+{
+    return pq->bound + pq->bound / 8 + 1;
+}
+
+/* Cut the list after its bound-th live node, and reclaim the rest.
+ * No other operation is in progress on the queue. Returns the number
+ * of nodes reclaimed. */
+static unsigned long
+trim_nodes(pq_t *pq)
+{
+    node_t *x, *y, *c, *nxt;
+    unsigned long n;
+    int i;
+
+    /* skip the deleted prefix */
+    c = get_head(pq);
+    nxt = get_next(c, 0);
+    while (is_marked_ref(nxt)) {
+        c = get_unmarked_ref(nxt);
+        nxt = get_next(c, 0);
+    }
+    for (n = 0; n < pq->bound && nxt != pq->tail; n++) {
+        c = nxt;
+        nxt = get_next(c, 0);
+    }
+    atomic_store_explicit(&pq->count, n, memory_order_relaxed);
+    if (nxt == pq->tail) return 0;
+    atomic_store_explicit(&pq->threshold, c->k, memory_order_relaxed);
+
+    /* The nodes after c, those with larger keys, are the physical end
+     * of every level. End each level before them. The nodes are not
+     * flagged, as pq_shape_report() may be reading them. */
+    x = get_head(pq);
+    for (i = NUM_LEVELS - 1; i > 0; i--) {
+        while ((y = get_next(x, i)) != pq->tail && y->k <= c->k)
+            x = y;
+        if (y != pq->tail)
+            set_next(x, i, pq->tail);
+    }
+    set_next(c, 0, pq->tail);
+
+    for (x = nxt, n = 0; x != pq->tail; x = y, n++) {
+        y = get_next(x, 0);
+        free_node(pq, x);
+    }
+    STAT_ADD(nodes_freed, n);
+    return n;
+}
+
+static void
+trim(pq_t *pq)
+{
+    unsigned long freed;
+    uint64_t t0;
+
+    /* one trim at a time, a concurrent one does the job */
+    if (atomic_fetch_or_explicit(&pq->gate, GATE_TRIM, memory_order_acquire)
+        & GATE_TRIM)
+        return;
+    while (atomic_load_explicit(&pq->gate, memory_order_acquire) != GATE_TRIM) ;
+
+    t0 = flight_tsc();
+    freed = trim_nodes(pq);
+    flight_event(EV_TRIM, t0, flight_tsc() - t0, freed);
+
+    atomic_fetch_and_explicit(&pq->gate, ~GATE_TRIM, memory_order_release);
+}
+
+static int
+insert_bounded(pq_t *pq, pkey_t k, pval_t v)
+{
+    int ok = 0;
+
+    gate_enter(pq);
+    /* the threshold may have dropped while waiting */
+    if (k < atomic_load_explicit(&pq->threshold, memory_order_relaxed))
+        ok = insert_nogc(pq, k, v);
+    gate_exit(pq);
+
+    if (ok && atomic_fetch_add_explicit(&pq->count, 1, memory_order_relaxed)
+        >= trim_limit(pq))
+        trim(pq);
+    return ok;
+}
+
+/***** per-thread state *****
+ * Relaxed and buffered queues keep state for each thread that uses
+ * them in a table of the queue, so that it goes with the queue. An
+ * entry starts with the id of its thread. A thread remembers its
+ * latest entry, with the serial number of the queue, which tells a
+ * new queue at the address of a destroyed one apart.
+ */
+typedef struct
+{
+    pq_t         *pq;
+    unsigned long serial;
+    void         *e;
+} local_hint_t;
+
+static _Atomic unsigned long next_tid = 1, next_serial = 1;
+static __thread unsigned long my_tid;
+
+static inline unsigned long
+thread_id(void)
+{
+    if (!my_tid)
+        my_tid = atomic_fetch_add_explicit(&next_tid, 1, memory_order_relaxed);
+    return my_tid;
+}
+
+/* Entry of the calling thread in pq, NULL if none. */
+static void *
+local_find(pq_t *pq, local_hint_t *h)
+{
+    unsigned long me = thread_id();
+    int n;
+    void *e;
+
+    if (h->pq == pq && h->serial == pq->serial)
+        return h->e;
+    n = atomic_load_explicit(&pq->nlocals, memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        e = atomic_load_explicit(&pq->locals[i], memory_order_acquire);
+        if (e && *(unsigned long *)e == me) {
+            h->pq = pq;
+            h->serial = pq->serial;
+            return h->e = e;
+        }
+    }
+    return NULL;
+}
+
+/* Add e as the entry of the calling thread in pq. Returns 0 if the
+ * table is full. */
+static int
+local_add(pq_t *pq, void *e, local_hint_t *h)
+{
+    int i = atomic_load_explicit(&pq->nlocals, memory_order_relaxed);
+
+    do {
+        if (i >= PQ_MAX_LOCALS)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&pq->nlocals, &i, i + 1));
+    *(unsigned long *)e = thread_id();
+    atomic_store_explicit(&pq->locals[i], e, memory_order_release);
+    h->pq = pq;
+    h->serial = pq->serial;
+    h->e = e;
+    return 1;
+}
+
+/***** insert buffers *****
+ * Each inserting thread of a buffered queue has a binary heap of
+ * elements, registered in pq->locals, with its smallest key published
+ * in min. The heap is locked by its thread to insert, and by a
+ * deleter that takes from it. When full, the elements are copied out,
+ * sorted, chained into a private staging queue like a skiplist built
+ * in order, and spliced in with pq_meld(). The heap stays locked and
+ * its min published until the meld is done, so that the elements are
+ * always in the heap or in pq, and only then is it emptied.
+ */
+typedef struct insbuf_s
+{
+    unsigned long  owner; /* thread id, see local_add() */
+    _Atomic int    lock;
+    _Atomic pkey_t min;   /* SENTINEL_KEYMAX if empty */
+    _Atomic unsigned long flushes; /* melds into pq so far */
+    int            n;
+    pq_t          *stage;
+    pkey_t         k[PQ_INSBUF_MAX];
+    pval_t         v[PQ_INSBUF_MAX];
+    char           pad[128];
+} insbuf_t;
+
+typedef struct
+{
+    pkey_t k;
+    pval_t v;
+} kv_t;
+
+static pq_t *new_queue(int max_offset, int level_bits);
+
+static __thread local_hint_t buf_hint;
+
+static inline void
+buf_lock(insbuf_t *b)
+{
+    while (atomic_exchange_explicit(&b->lock, 1, memory_order_acquire))
+        while (atomic_load_explicit(&b->lock, memory_order_relaxed)) ;
+}
+
+static inline void
+buf_unlock(insbuf_t *b)
+{
+    atomic_store_explicit(&b->min, b->n ? b->k[0] : SENTINEL_KEYMAX,
+                          memory_order_relaxed);
+    atomic_store_explicit(&b->lock, 0, memory_order_release);
+}
+
+static void
+heap_push(insbuf_t *b, pkey_t k, pval_t v)
+{
+    int i, p;
+
+    for (i = b->n++; i > 0 && b->k[p = (i - 1) / 2] > k; i = p) {
+        b->k[i] = b->k[p];
+        b->v[i] = b->v[p];
+    }
+    b->k[i] = k;
+    b->v[i] = v;
+}
+
+static void
+heap_pop(insbuf_t *b)
+{
+    pkey_t k = b->k[--b->n];
+    pval_t v = b->v[b->n];
+    int i = 0, c;
+
+    while ((c = 2 * i + 1) < b->n) {
+        if (c + 1 < b->n && b->k[c + 1] < b->k[c]) c++;
+        if (k <= b->k[c]) break;
+        b->k[i] = b->k[c];
+        b->v[i] = b->v[c];
+        i = c;
+    }
+    b->k[i] = k;
+    b->v[i] = v;
+}
+
+static int
+kv_cmp(const void *a, const void *b)
+{
+    pkey_t x = ((const kv_t *)a)->k, y = ((const kv_t *)b)->k;
+    return (x > y) - (x < y);
+}
+
+static void
+buf_flush(pq_t *pq, insbuf_t *b)
+{
+    kv_t run[PQ_INSBUF_MAX];
+    node_t *last[NUM_LEVELS], *x, *h = get_head(b->stage);
+    int n, i, l;
+
+    buf_lock(b);
+    for (n = 0; n < b->n; n++) {
+        run[n].k = b->k[n];
+        run[n].v = b->v[n];
+    }
+    if (!n) {
+        buf_unlock(b);
+        return;
+    }
+    qsort(run, n, sizeof *run, kv_cmp);
+
+    op_enter();
+    for (l = 0; l < NUM_LEVELS; l++)
+        last[l] = h;
+    for (i = 0; i < n; i++) {
+        if (i && run[i].k == run[i - 1].k)
+            continue;
+        x = alloc_node(pq);
+        x->k = run[i].k;
+        x->v = run[i].v;
+        for (l = 0; l < x->level; l++) {
+            set_next(last[l], l, x);
+            last[l] = x;
+        }
+    }
+    for (l = 0; l < NUM_LEVELS; l++)
+        set_next(last[l], l, b->stage->tail);
+    op_exit();
+
+    pq_meld(pq, b->stage);
+    b->n = 0;
+    atomic_fetch_add_explicit(&b->flushes, 1, memory_order_release);
+    buf_unlock(b);
+}
+
+/* Returns 0 if the element could not be buffered, as the table of
+ * buffers is full. */
+static int
+buffered_insert(pq_t *pq, pkey_t k, pval_t v)
+{
+    insbuf_t *b = local_find(pq, &buf_hint);
+    int full;
+
+    if (b == NULL) {
+        /* first insert of this thread into pq */
+        b = calloc(1, sizeof *b);
+        atomic_init(&b->min, SENTINEL_KEYMAX);
+        b->stage = new_queue(pq->max_offset, pq->level_bits);
+        if (!local_add(pq, b, &buf_hint)) {
+            pq_destroy(b->stage);
+            free(b);
+            return 0;
+        }
+    }
+
+    buf_lock(b);
+    heap_push(b, k, v);
+    /* deleters may have left an element more */
+    full = b->n >= pq->insbuf;
+    buf_unlock(b);
+    if (full)
+        buf_flush(pq, b);
+    return 1;
+}
+
+/* Write the eventfd of pq, if the queue was found empty since the
+ * last write, see pq_eventfd_deletemin(). The fence orders the insert
+ * before the load of armed, as the fence after the arming orders it
+ * before the deletemin, so that either the insert is seen or the
+ * eventfd is written. */
+static inline void
+notify(pq_t *pq)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pq->armed, memory_order_relaxed) &&
+        atomic_exchange_explicit(&pq->armed, 0, memory_order_relaxed))
+        E(eventfd_write(pq->efd, 1));
+}
+
+void 
+insert(pq_t *pq, pkey_t k, pval_t v)
+{
+    int ok = 1;
+
+    assert(SENTINEL_KEYMIN < k && k < SENTINEL_KEYMAX);
+    assert(pq->reuse == NULL);
+    /* common case of a full bounded queue, before anything else */
+    if (pq->bound &&
+        k >= atomic_load_explicit(&pq->threshold, memory_order_relaxed))
+        return;
+    trace(TRACE_INSERT, k);
+    /* threads beyond the table of buffers insert directly */
+    if (!pq->insbuf || !buffered_insert(pq, k, v)) {
+        op_enter();
+        if (pq->bound)
+            ok = insert_bounded(pq, k, v);
+        else
+            ok = insert_nogc(pq, k, v);
+        op_exit();
+    }
+    /* rejected or duplicate, nothing new to announce */
+    if (!ok)
+        return;
+    if (pq->block &&
+        k < atomic_load_explicit(&pq->frontier, memory_order_relaxed))
+        atomic_fetch_add(&pq->front_inserts, 1);
+    if (pq->efd >= 0)
+        notify(pq);
 }
 
 
@@ -256,30 +827,31 @@ insert(pq_t *pq, pkey_t k, pval_t v)
 static void
 restructure(pq_t *pq)
 {
-    node_t *pred, *cur, *h;
+    node_t *head, *pred, *cur, *h;
     int i = NUM_LEVELS - 1;
 
-    pred = pq->head;
+    /* one head throughout, pq_clear() may replace it */
+    pred = head = get_head(pq);
     while (i > 0) {
-        /* the order of these reads must be maintained */
-        h = pq->head->next[i]; /* record observed head */
-        CMB();
-        cur = pred->next[i]; /* take one step forward from pred */
-        if (!is_marked_ref(h->next[0])) {
+        STAT_INC(restructure_iters);
+        /* the order of these reads must be maintained, by acquire */
+        h = get_next(head, i); /* record observed head */
+        cur = get_next(pred, i); /* take one step forward from pred */
+        if (!is_marked_ref(get_next_rlx(h, 0))) {
             i--;
             continue;
         }
         /* traverse level until non-marked node is found
          * pred will always have its delete flag set
          */
-        while(is_marked_ref(cur->next[0])) {
+        while(is_marked_ref(get_next_rlx(cur, 0))) {
             pred = cur;
-            cur = pred->next[i];
+            cur = get_next(pred, i);
         }
-        assert(is_marked_ref(pred->next[0]));
+        assert(is_marked_ref(get_next_rlx(pred, 0)));
 	
         /* swing head pointer */
-        if (__sync_bool_compare_and_swap(&pq->head->next[i],h,cur))
+        if (cas_next(head, i, h, cur, memory_order_release))
             i--;
     }
 }
@@ -292,70 +864,85 @@ restructure(pq_t *pq)
  *
  * Traverse level 0 next pointers until one is found that does
  * not have the delete bit set. 
+ *
+ * delete_nodes deletes up to n consecutive nodes, by going on from
+ * the last one deleted, stores them in out, and returns how many it
+ * got, 0 if the queue is empty. It must be called within a critical
+ * section.
  */
-pval_t
-deletemin(pq_t *pq)
+static int
+delete_nodes(pq_t *pq, node_t **out, int n)
 {
-    pval_t   v = NULL;
-    node_t *x, *nxt, *obs_head = NULL, *newhead, *cur;
-    int offset, lvl;
+    node_t *head, *x, *nxt, *obs_head = NULL, *newhead, *cur;
+    int offset, lvl, freed = 0, got = 0;
+    uint64_t t0;
     
     newhead = NULL;
     offset = lvl = 0;
 
-    critical_enter();
+    STAT_INC(deletemins);
 
-    x = pq->head;
-    obs_head = x->next[0];
+    x = head = get_head(pq);
+    obs_head = get_next(x, 0);
 
     do {
         offset++;
 
         /* expensive, high probability that this cache line has
          * been modified */
-        nxt = x->next[0];
+        nxt = get_next(x, 0);
 
         // tail cannot be deleted
         if (get_unmarked_ref(nxt) == pq->tail) {
-            goto out;
+            if (got) break;
+            STAT_INC(empty);
+            return 0;
         }
+        /* next[0] and inserting of the next node, while this one is
+         * tested and marked */
+        prefetch_node(get_unmarked_ref(nxt), 0);
 
         /* Do not allow head to point past a node currently being
          * inserted. This makes the lock-freedom quite a theoretic
          * matter. */
-        if (newhead == NULL && x->inserting) newhead = x;
+        if (newhead == NULL && get_inserting(x)) newhead = x;
 
         /* optimization */
         if (is_marked_ref(nxt)) continue;
         /* the marker is on the preceding pointer */
         /* linearisation point deletemin */
-        nxt = __sync_fetch_and_or(&x->next[0], 1);
+        nxt = mark_next(x);
+        if (!is_marked_ref(nxt))
+            out[got++] = get_unmarked_ref(nxt);
     }
-    while ( (x = get_unmarked_ref(nxt)) && is_marked_ref(nxt) );
+    while ( (x = get_unmarked_ref(nxt)) && got < n );
 
-    assert(!is_marked_ref(x));
-
-    v = x->v;
-
-    
     /* If no inserting node was traversed, then use the latest 
      * deleted node as the new lowest-level head pointed node
      * candidate. */
-    if (newhead == NULL) newhead = x;
+    if (newhead == NULL) newhead = out[got - 1];
+
+    STAT_INC(offset_hist[min(31 - __builtin_clz(offset),
+                             STATS_OFFSET_BUCKETS - 1)]);
 
     /* if the offset is big enough, try to update the head node and
      * perform memory reclamation */
     if (offset <= pq->max_offset) goto out;
 
     /* Optimization. Marginally faster */
-    if (pq->head->next[0] != obs_head) goto out;
+    if (get_next_rlx(head, 0) != obs_head) goto out;
     
     /* try to swing the lowest level head pointer to point to newhead,
      * which is deleted */
-    if (__sync_bool_compare_and_swap(&pq->head->next[0], obs_head, get_marked_ref(newhead)))
+    STAT_INC(swing_attempts);
+    if (cas_next(head, 0, obs_head, get_marked_ref(newhead),
+                 memory_order_acq_rel))
     {
+        STAT_INC(swing_wins);
         /* Update higher level pointers. */
+        t0 = flight_tsc();
         restructure(pq);
+        flight_event(EV_RESTRUCTURE, t0, flight_tsc() - t0, 0);
 
         /* We successfully swung the upper head pointer. The nodes
          * between the observed head (obs_head) and the new bottom
@@ -364,66 +951,866 @@ deletemin(pq_t *pq)
 
         cur = get_unmarked_ref(obs_head);
         while (cur != get_unmarked_ref(newhead)) {
-            nxt = get_unmarked_ref(cur->next[0]);
-            assert(is_marked_ref(cur->next[0]));
-            free_node(cur);
+            nxt = get_unmarked_ref(get_next_rlx(cur, 0));
+            assert(is_marked_ref(get_next_rlx(cur, 0)));
+            free_node(pq, cur);
+            freed++;
             cur = nxt;
         }
+        STAT_ADD(nodes_freed, freed);
+        flight_event(EV_SWING, t0, 0, freed);
     }
  out:
-    critical_exit();
+    return got;
+}
+
+static node_t *
+delete_node(pq_t *pq)
+{
+    node_t *x;
+    return delete_nodes(pq, &x, 1) ? x : NULL;
+}
+
+static pval_t
+deletemin_nogc(pq_t *pq, pkey_t *k)
+{
+    node_t  *x;
+
+    if ((x = delete_node(pq)) == NULL) {
+        *k = KEY_NULL;
+        return NULL;
+    }
+    *k = x->k;
+    return x->v;
+}
+
+/***** relaxed deletemin *****
+ * A thread claims a block of consecutive nodes with one prefix walk,
+ * copies them out in the critical section, and serves them one by
+ * one. The block is stale once pq->front_inserts has moved, i.e., a
+ * key below the latest claimed one has been inserted, and is then put
+ * back. A pq_clear() counts in pq->clears, and drops the block; the
+ * head pointer cannot tell, as a new head may reuse the old address.
+ */
+typedef struct
+{
+    unsigned long owner; /* thread id, see local_add() */
+    unsigned long clears; /* pq->clears after the claim */
+    unsigned long seen;  /* pq->front_inserts at the claim */
+    int           i, n;
+    pkey_t        k[PQ_BLOCK_MAX];
+    pval_t        v[PQ_BLOCK_MAX];
+} dq_cache_t;
+
+static __thread local_hint_t dq_hint;
+
+/* An element whose key has been inserted again meanwhile cannot be
+ * put back, and is kept in the block, which is current again. */
+static void
+cache_putback(pq_t *pq, dq_cache_t *c)
+{
+    int m = 0, put = c->n - c->i;
+
+    op_enter();
+    for (; c->i < c->n; c->i++)
+        if (!insert_nogc(pq, c->k[c->i], c->v[c->i])) {
+            c->k[m] = c->k[c->i];
+            c->v[m++] = c->v[c->i];
+        }
+    op_exit();
+    c->i = 0;
+    c->n = m;
+    /* the elements are below other blocks now */
+    atomic_fetch_add(&pq->front_inserts, 1);
+    c->seen = atomic_load(&pq->front_inserts);
+    /* an eventfd consumer may have found the queue empty meanwhile */
+    if (m < put && pq->efd >= 0)
+        notify(pq);
+}
+
+static pval_t
+relaxed_deletemin(pq_t *pq, pkey_t *k)
+{
+    node_t *xs[PQ_BLOCK_MAX];
+    dq_cache_t *c = local_find(pq, &dq_hint);
+    pval_t v;
+
+    if (c == NULL) {
+        c = calloc(1, sizeof *c);
+        if (!local_add(pq, c, &dq_hint)) {
+            free(c);
+            op_enter();
+            v = deletemin_nogc(pq, k);
+            op_exit();
+            return v;
+        }
+    }
+
+    if (c->i < c->n) {
+        if (c->clears != atomic_load(&pq->clears))
+            c->i = c->n = 0;
+        else if (atomic_load_explicit(&pq->front_inserts,
+                                      memory_order_acquire) != c->seen)
+            cache_putback(pq, c);
+        if (c->i < c->n) {
+            *k = c->k[c->i];
+            return c->v[c->i++];
+        }
+    }
+
+    op_enter();
+    c->i = 0;
+    c->n = delete_nodes(pq, xs, pq->block);
+    /* after the claim: a block claimed from a new head is never
+     * counted as cleared, see pq_clear() */
+    c->clears = atomic_load(&pq->clears);
+    for (int j = 0; j < c->n; j++) {
+        c->k[j] = xs[j]->k;
+        c->v[j] = xs[j]->v;
+    }
+    op_exit();
+
+    if (!c->n) {
+        *k = KEY_NULL;
+        return NULL;
+    }
+    atomic_store(&pq->frontier, c->k[c->n - 1]);
+    c->seen = atomic_load(&pq->front_inserts);
+    *k = c->k[0];
+    return c->v[c->i++];
+}
+
+/* Take the smaller of the queue's minimum and the smallest buffered
+ * element. A deleted node with a larger key than a buffer's minimum
+ * takes its place in the buffer. The buffers are read before the
+ * queue: a buffer flushed meanwhile had its elements in pq before
+ * the deletion, or still has its min published, and then is found
+ * flushed under its lock. The deleted element then goes into that
+ * heap, if it has room, and the deletion is done again. */
+static pval_t
+buffered_deletemin(pq_t *pq, pkey_t *k)
+{
+    insbuf_t *b, *best;
+    unsigned long seen = 0;
+    pkey_t kx, m;
+    pval_t v, vx;
+    node_t *x;
+    int n;
+
+ retry:
+    best = NULL;
+    m = SENTINEL_KEYMAX;
+    n = atomic_load_explicit(&pq->nlocals, memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        if (!(b = atomic_load_explicit(&pq->locals[i], memory_order_acquire)))
+            continue;
+        if (atomic_load_explicit(&b->min, memory_order_relaxed) < m) {
+            m = atomic_load_explicit(&b->min, memory_order_relaxed);
+            /* a flush seen here is seen by the deletion */
+            seen = atomic_load_explicit(&b->flushes, memory_order_acquire);
+            best = b;
+        }
+    }
+
+    op_enter();
+    x = delete_node(pq);
+    kx = x ? x->k : SENTINEL_KEYMAX;
+    vx = x ? x->v : NULL;
+    op_exit();
+
+    if (best && m < kx) {
+        buf_lock(best);
+        if (atomic_load_explicit(&best->flushes, memory_order_relaxed) != seen &&
+            (!x || best->n < PQ_INSBUF_MAX)) {
+            /* its elements went into pq after the deletion */
+            if (x)
+                heap_push(best, kx, vx);
+            buf_unlock(best);
+            goto retry;
+        }
+        if (best->n && best->k[0] < kx) {
+            *k = best->k[0];
+            v = best->v[0];
+            heap_pop(best);
+            if (x)
+                heap_push(best, kx, vx);
+            buf_unlock(best);
+            return v;
+        }
+        buf_unlock(best);
+    }
+    *k = x ? kx : KEY_NULL;
+    return vx;
+}
+
+void
+pq_insert_flush(pq_t *pq)
+{
+    insbuf_t *b = local_find(pq, &buf_hint);
+
+    if (b)
+        buf_flush(pq, b);
+}
+
+int
+pq_cache_flush(pq_t *pq)
+{
+    dq_cache_t *c = local_find(pq, &dq_hint);
+
+    if (c == NULL)
+        return 0;
+    if (c->clears != atomic_load(&pq->clears))
+        c->i = c->n = 0;
+    else if (c->i < c->n)
+        cache_putback(pq, c);
+    return c->n - c->i;
+}
+
+pval_t
+deletemin(pq_t *pq)
+{
+    pval_t   v;
+    pkey_t   k;
+
+    assert(pq->reuse == NULL);
+    if (pq->block || pq->insbuf) {
+        v = pq->block ? relaxed_deletemin(pq, &k) : buffered_deletemin(pq, &k);
+        trace(TRACE_DELETEMIN, k);
+        return v;
+    }
+    op_enter();
+    if (pq->bound) {
+        gate_enter(pq);
+        v = deletemin_nogc(pq, &k);
+        gate_exit(pq);
+        if (k != KEY_NULL)
+            atomic_fetch_sub_explicit(&pq->count, 1, memory_order_relaxed);
+    } else {
+        v = deletemin_nogc(pq, &k);
+    }
+    op_exit();
+    trace(TRACE_DELETEMIN, k);
     return v;
 }
 
+
+/***** readiness eventfd *****
+ * The eventfd is written once per transition to non-empty: armed is
+ * set by a consumer that finds the queue empty, and cleared by the
+ * first insert to come after, which alone writes.
+ */
+int
+pq_eventfd(pq_t *pq)
+{
+#if defined(__linux__)
+    assert(pq->efd < 0);
+    if ((pq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    atomic_store(&pq->armed, 1);
+    return pq->efd;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+pval_t
+pq_eventfd_deletemin(pq_t *pq)
+{
+    eventfd_t n;
+    pval_t v;
+
+    assert(pq->efd >= 0);
+    if ((v = deletemin(pq)) != NULL ||
+        atomic_load_explicit(&pq->armed, memory_order_relaxed))
+        return v;
+    /* still armed means not written since, no syscalls then */
+    (void)eventfd_read(pq->efd, &n);
+    atomic_store(&pq->armed, 1);
+    /* pairs with the fence of notify(), orders the arming before the
+     * loads of the deletemin */
+    atomic_thread_fence(memory_order_seq_cst);
+    return deletemin(pq);
+}
+
+
+/***** intrusive interface *****
+ * The caller owns the links. A link is initialised like a node, with
+ * the reuse callback as its value, and is handed back through the
+ * callback from a GC hook once it has been reclaimed.
+ */
+int
+pq_link_insert(pq_t *pq, pq_link_t *l, pkey_t k)
+{
+    node_t *new = &l->n;
+    int level, ok;
+
+    assert(SENTINEL_KEYMIN < k && k < SENTINEL_KEYMAX);
+    assert(pq->reuse != NULL);
+    trace(TRACE_INSERT, k);
+    op_enter();
+    STAT_INC(inserts);
+
+    level = min(random_level(pq), PQ_LINK_LEVELS);
+    new->k = k;
+    new->v = (pval_t) pq->reuse;
+    new->level = level;
+    atomic_init(&new->inserting, level > 1);
+    memset(new->next, 0, level * sizeof(node_t *));
+
+    ok = insert_node(pq, new);
+
+    op_exit();
+    if (ok && pq->efd >= 0)
+        notify(pq);
+    return ok;
+}
+
+pq_link_t *
+pq_link_deletemin(pq_t *pq)
+{
+    node_t *x;
+
+    assert(pq->reuse != NULL);
+    op_enter();
+    x = delete_node(pq);
+    op_exit();
+    trace(TRACE_DELETEMIN, x ? x->k : KEY_NULL);
+    return (pq_link_t *)x;
+}
+
+/* Number of deleted nodes preceding the first live node at the
+ * bottom level. Safe to call on a live queue. */
+unsigned long
+pq_prefix_length(pq_t *pq)
+{
+    node_t *x;
+    unsigned long n = 0;
+
+    critical_enter();
+    /* a node is deleted when the pointer leading to it is marked */
+    x = get_next(get_head(pq), 0);
+    while (is_marked_ref(x)) {
+        n++;
+        x = get_next((node_t *)get_unmarked_ref(x), 0);
+    }
+    critical_exit();
+    return n;
+}
+
+void
+pq_stats_snapshot(pq_stats_t *s)
+{
+    memset(s, 0, sizeof *s);
+#ifdef PQ_STATS
+    _Static_assert(STAT_WORDS <= PTST_COUNTERS, "pq_stats_t too large");
+    unsigned long *sum = (unsigned long *)s;
+    for (ptst_t *p = ptst_first(); p != NULL; p = ptst_next(p))
+        for (size_t i = 0; i < STAT_WORDS; i++)
+            sum[i] += atomic_load_explicit(&p->counters[i],
+                                           memory_order_relaxed);
+#endif
+}
+
+static int
+ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = *(uintptr_t *)a, y = *(uintptr_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void
+pq_shape_report(pq_t *pq, pq_shape_t *s)
+{
+    node_t *head, *x, *nxt;
+    unsigned long pos = 0, first_live = 0;
+    unsigned long at[NUM_LEVELS], ndel = 0, cap = 0;
+    node_t **del = NULL;
+    int i, j, d;
+
+    memset(s, 0, sizeof *s);
+    critical_enter();
+    head = get_head(pq);
+
+    /* bottom level position of each head pointer, found on the way */
+    for (i = 0; i < NUM_LEVELS; i++)
+        at[i] = ~0UL;
+
+    /* a node is deleted when the pointer leading to it is marked */
+    nxt = get_next(head, 0);
+    x = get_unmarked_ref(nxt);
+    while (x != pq->tail) {
+        d = is_marked_ref(nxt);
+        nxt = get_next(x, 0);
+        for (i = 0; i < NUM_LEVELS; i++)
+            if (get_unmarked_ref(get_next_rlx(head, i)) == x) at[i] = pos;
+        if (atomic_load_explicit(&x->inserting, memory_order_relaxed))
+            s->inserting++;
+        if (!d) {
+            if (s->live++ == 0) first_live = pos;
+            s->level_hist[x->level - 1]++;
+        } else {
+            if (ndel == cap) {
+                cap = cap ? 2 * cap : 64;
+                E_NULL(del = realloc(del, cap * sizeof *del));
+            }
+            del[ndel++] = x;
+        }
+        pos++;
+        x = get_unmarked_ref(nxt);
+    }
+    if (s->live == 0) first_live = pos;
+
+    /* keys in the deleted prefix are not ordered with respect to the
+     * live nodes, so look the upper level nodes up among the deleted */
+    qsort(del, ndel, sizeof *del, ptr_cmp);
+    for (i = 0; i < NUM_LEVELS; i++) {
+        if (at[i] != ~0UL && at[i] < first_live)
+            s->lag[i] = first_live - at[i];
+        x = get_unmarked_ref(get_next(head, i));
+        while (x != pq->tail && bsearch(&x, del, ndel, sizeof *del, ptr_cmp)) {
+            s->prefix[i]++;
+            x = get_unmarked_ref(get_next(x, i));
+        }
+    }
+    free(del);
+
+    for (i = 0; i < NUM_LEVELS; i++) {
+        for (j = 0; j < i && gc_id[j] != gc_id[i]; j++) ;
+        if (j < i || s->npools == SHAPE_MAX_POOLS) continue;
+        gc_allocator_info(gc_id[i], &s->pool_blk_size[s->npools],
+                          &s->pool_heap_size[s->npools]);
+        s->npools++;
+    }
+
+    critical_exit();
+}
+
+void
+pq_shape_print(FILE *out, pq_shape_t *s)
+{
+    int top = NUM_LEVELS - 1;
+
+    while (top > 0 && !s->level_hist[top] && !s->prefix[top]) top--;
+
+    fprintf(out, "live %lu, inserting %lu\n", s->live, s->inserting);
+    fprintf(out, "%6s %10s %10s %10s\n", "level", "live", "prefix", "lag");
+    for (int i = 0; i <= top; i++)
+        fprintf(out, "%6d %10lu %10lu %10lu\n", i + 1, s->level_hist[i],
+                s->prefix[i], s->lag[i]);
+    fprintf(out, "%10s %12s\n", "block", "heap");
+    for (int i = 0; i < s->npools; i++)
+        fprintf(out, "%10u %12lu\n", s->pool_blk_size[i], s->pool_heap_size[i]);
+}
+
 /*
  * Init structure, setup sentinel head and tail nodes.
  */
 pq_t *
 pq_init(int max_offset)
+{
+    return pq_init_branching(max_offset, 1);
+}
+
+/* A head node, all of whose levels point at t. */
+static node_t *
+new_head(node_t *t)
+{
+    node_t *h = calloc(1, sizeof *h + (NUM_LEVELS-1)*sizeof(node_t *));
+
+    atomic_init(&h->inserting, 0);
+    h->k = SENTINEL_KEYMIN;
+    h->level = NUM_LEVELS;
+    h->v = (pval_t) t;
+    for (int i = 0; i < NUM_LEVELS; i++ )
+        atomic_init(&h->next[i], t);
+    return h;
+}
+
+/* The queue alone; pq_init_branching() also registers its node sizes
+ * and hooks with the GC, which is not thread safe. */
+static pq_t *
+new_queue(int max_offset, int level_bits)
 {
     pq_t *pq;
-    node_t *t, *h;
-    int i;
+    node_t *t;
 
     /* head and tail nodes */
     t = calloc(1, sizeof *t + (NUM_LEVELS-1)*sizeof(node_t *));
-    h = calloc(1, sizeof *h + (NUM_LEVELS-1)*sizeof(node_t *));
-    
-    t->inserting = 0;
-    h->inserting = 0;
-
+    atomic_init(&t->inserting, 0);
     t->k = SENTINEL_KEYMAX;
-    h->k = SENTINEL_KEYMIN;
-    h->level = NUM_LEVELS;
     t->level = NUM_LEVELS;
-    
-    for ( i = 0; i < NUM_LEVELS; i++ )
-        h->next[i] = t;
 
     pq = malloc(sizeof *pq);
-    pq->head = h;
+    atomic_init(&pq->head, new_head(t));
     pq->tail = t;
     pq->max_offset = max_offset;
+    assert(1 <= level_bits && level_bits <= 3);
+    pq->level_bits = level_bits;
+    pq->reuse = NULL;
+    pq->bound = 0;
+    atomic_init(&pq->count, 0);
+    atomic_init(&pq->threshold, SENTINEL_KEYMAX);
+    atomic_init(&pq->gate, 0);
+    pq->efd = -1;
+    atomic_init(&pq->armed, 0);
+    atomic_init(&pq->clears, 0);
+    pq->block = 0;
+    atomic_init(&pq->frontier, SENTINEL_KEYMIN);
+    atomic_init(&pq->front_inserts, 0);
+    pq->serial = atomic_fetch_add_explicit(&next_serial, 1,
+                                           memory_order_relaxed);
+    atomic_init(&pq->nlocals, 0);
+    pq->locals = NULL;
+    pq->insbuf = 0;
+    return pq;
+}
 
+/*
+ * Init structure with level probability 2^-level_bits, setup
+ * sentinel head and tail nodes.
+ */
+pq_t *
+pq_init_branching(int max_offset, int level_bits)
+{
+    int ids[NUM_LEVELS], hook;
+
+    /* the ids are shared by all queues, only set them once all are
+     * registered */
+    for (int i = 0; i < NUM_LEVELS; i++ )
+	if ((ids[i] = gc_add_allocator(sizeof(node_t) +
+				       i*sizeof(node_t *))) < 0)
+	    goto full;
+    if ((hook = gc_add_hook(chain_reclaimed)) < 0)
+	goto full;
     for (int i = 0; i < NUM_LEVELS; i++ )
-	gc_id[i] = gc_add_allocator(sizeof(node_t) + i*sizeof(node_t *));
+	gc_id[i] = ids[i];
+    clear_hook_id = hook;
 
+    return new_queue(max_offset, level_bits);
+ full:
+    errno = ENOSPC;
+    return NULL;
+}
+
+/*
+ * Init a relaxed queue, see relaxed_deletemin().
+ */
+pq_t *
+pq_init_relaxed(int max_offset, int block)
+{
+    pq_t *pq = pq_init(max_offset);
+    if (pq == NULL)
+        return NULL;
+    assert(1 <= block && block <= PQ_BLOCK_MAX);
+    pq->block = block;
+    pq->locals = calloc(PQ_MAX_LOCALS, sizeof *pq->locals);
     return pq;
 }
 
+/*
+ * Init a buffered queue, see buffered_insert().
+ */
+pq_t *
+pq_init_buffered(int max_offset, int insbuf)
+{
+    pq_t *pq = pq_init(max_offset);
+    if (pq == NULL)
+        return NULL;
+    assert(1 <= insbuf && insbuf <= PQ_INSBUF_MAX);
+    pq->insbuf = insbuf;
+    pq->locals = calloc(PQ_MAX_LOCALS, sizeof *pq->locals);
+    return pq;
+}
+
+/*
+ * Init a bounded queue, see trim().
+ */
+pq_t *
+pq_init_bounded(int max_offset, unsigned long bound)
+{
+    pq_t *pq = pq_init(max_offset);
+    if (pq == NULL)
+        return NULL;
+    assert(bound > 0);
+    pq->bound = bound;
+    return pq;
+}
+
+/*
+ * Init an intrusive queue, see pq_link_insert().
+ */
+pq_t *
+pq_init_intrusive(int max_offset, pq_reuse_fn_t reuse)
+{
+    pq_t *pq = pq_init(max_offset);
+    if (pq == NULL)
+        return NULL;
+    if ((pq->hook_id = gc_add_hook(link_reclaimed)) < 0) {
+        pq_destroy(pq);
+        errno = ENOSPC;
+        return NULL;
+    }
+    pq->reuse = reuse;
+    return pq;
+}
+
+/* Replace the head by a new one, leading straight to the tail. An
+ * operation that loaded the old head runs to completion on the old
+ * nodes, and its CASes on them cannot affect the new list, as the
+ * two only share the tail. An insert that succeeds on the old nodes
+ * loaded the old head before the exchange, so it is ordered before
+ * the clear. Marking the head's next[0] instead would not do: the
+ * nodes it skips keep unmarked next pointers, which inserts reach
+ * through upper levels, and closing them off means marking every
+ * node. A bounded queue is cleared between trims, so that a trim
+ * never walks from the wrong head. The count goes up before the
+ * exchange, so a relaxed block claimed from the new head sees it. */
+void
+pq_clear(pq_t *pq)
+{
+    node_t *old, *h;
+
+    assert(pq->reuse == NULL);
+    h = new_head(pq->tail);
+    op_enter();
+    if (pq->bound) gate_enter(pq);
+    atomic_fetch_add(&pq->clears, 1);
+    old = atomic_exchange_explicit(&pq->head, h, memory_order_acq_rel);
+    if (pq->bound) {
+        atomic_store_explicit(&pq->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&pq->threshold, SENTINEL_KEYMAX,
+                              memory_order_relaxed);
+        gate_exit(pq);
+    }
+    gc_add_ptr_to_hook_list(ptst, old, clear_hook_id);
+    op_exit();
+    /* elements in insert buffers are cleared too */
+    if (pq->insbuf)
+        for (int i = 0; i < atomic_load(&pq->nlocals); i++) {
+            insbuf_t *b = atomic_load(&pq->locals[i]);
+            if (b == NULL)
+                continue;
+            buf_lock(b);
+            b->n = 0;
+            buf_unlock(b);
+        }
+}
+
+/***** meld *****
+ *
+ * The live nodes of src are taken in key order, in runs that fit
+ * between two adjacent bottom level nodes of dst, found by one
+ * locate_preds() per run. A run is still chained by its src next
+ * pointers, so it is linked in at the bottom level with one CAS, as
+ * one insert, and then at each upper level with one CAS for all its
+ * nodes of that level. cur[i] is the first src node of level i not
+ * melded yet; it is read before the last node of a run at level i is
+ * pointed into dst.
+ */
+static void
+meld_upper(pq_t *dst, node_t *first, node_t *last, node_t **cur,
+           node_t **preds, node_t **succs, node_t *del, node_t *tail)
+{
+    node_t *b, *e, *nx;
+    int i, done = 0;
+
+    for (i = 1; i < NUM_LEVELS; i++) {
+        b = cur[i];
+        if (b == tail || b->k > last->k)
+            break;
+        for (e = b; (nx = get_next_rlx(e, i)) != tail && nx->k <= last->k; )
+            e = nx;
+        cur[i] = nx;
+
+        while (!done) {
+            /* as in insert_node(), stop once the run is being deleted */
+            if (is_marked_ref(get_next_rlx(e, 0)) ||
+                is_marked_ref(get_next_rlx(succs[i], 0)) ||
+                del == succs[i] || succs[i]->k <= e->k) {
+                done = 1;
+                break;
+            }
+            set_next(e, i, succs[i]);
+            if (cas_next(preds[i], i, succs[i], b, memory_order_release))
+                break;
+            STAT_INC(insert_retries_upper);
+            del = locate_preds(dst, b->k, preds, succs);
+            if (succs[0] != b) done = 1;
+        }
+    }
+}
+
+void
+pq_meld(pq_t *dst, pq_t *src)
+{
+    node_t *preds[NUM_LEVELS], *succs[NUM_LEVELS], *cur[NUM_LEVELS];
+    node_t *sh = get_head(src), *tail = src->tail;
+    node_t *x, *y, *last, *after, *del, *prefix;
+    unsigned long n;
+    int i;
+
+    assert(dst->reuse == NULL && src->reuse == NULL);
+    assert(!dst->bound && !src->bound);
+    op_enter();
+
+    /* Flag the deleted prefix of src, by a negative level, to start
+     * each level after it. */
+    prefix = get_unmarked_ref(get_next(sh, 0));
+    x = sh;
+    while (is_marked_ref(get_next(x, 0))) {
+        x = get_unmarked_ref(get_next(x, 0));
+        x->level = -x->level;
+    }
+    x = get_unmarked_ref(get_next(x, 0));
+    for (i = 1; i < NUM_LEVELS; i++)
+        for (cur[i] = get_next(sh, i); cur[i] != tail && cur[i]->level < 0; )
+            cur[i] = get_next(cur[i], i);
+
+    while (x != tail) {
+    retry:
+        del = locate_preds(dst, x->k, preds, succs);
+
+        if (succs[0]->k == x->k && get_next(preds[0], 0) == succs[0]) {
+            /* already in dst */
+            STAT_INC(duplicates);
+            for (i = 1; i < x->level; i++)
+                cur[i] = get_next_rlx(x, i);
+            y = get_next_rlx(x, 0);
+            free_node(dst, x);
+            x = y;
+            continue;
+        }
+
+        /* the run is the nodes below succs[0] */
+        n = 1;
+        for (last = x; (y = get_next_rlx(last, 0)) != tail && y->k < succs[0]->k; n++) {
+            atomic_store_explicit(&last->inserting, last->level > 1,
+                                  memory_order_relaxed);
+            last = y;
+        }
+        atomic_store_explicit(&last->inserting, last->level > 1,
+                              memory_order_relaxed);
+        after = y;
+
+        set_next(last, 0, succs[0]);
+        if (!cas_next(preds[0], 0, succs[0], x, memory_order_release)) {
+            STAT_INC(insert_retries);
+            set_next(last, 0, after);
+            goto retry;
+        }
+        STAT_ADD(inserts, n);
+
+        meld_upper(dst, x, last, cur, preds, succs, del, tail);
+
+        /* deletemins on dst may have marked the run by now */
+        for (y = x; ; y = get_unmarked_ref(get_next_rlx(y, 0))) {
+            clear_inserting(y);
+            if (y == last) break;
+        }
+        x = after;
+    }
+
+    /* src is empty, reclaim its deleted prefix */
+    for (i = 0; i < NUM_LEVELS; i++)
+        set_next(sh, i, tail);
+    for (x = prefix; x != tail && x->level < 0; x = y) {
+        y = get_unmarked_ref(get_next_rlx(x, 0));
+        x->level = -x->level;
+        free_node(src, x);
+    }
+    op_exit();
+    if (dst->efd >= 0)
+        notify(dst);
+}
+
+/***** split *****
+ *
+ * The nodes at or above k run into the tail of pq at every level, so
+ * the new queue takes over that tail, and pq gets the new one. Each
+ * level is cut before its first live node at or above k. The deleted
+ * prefix stays in pq, whatever its keys, so it is flagged by a
+ * negative level, as in pq_meld(), and skipped at every level.
+ */
+pq_t *
+pq_split(pq_t *pq, pkey_t k)
+{
+    pq_t *hi = new_queue(pq->max_offset, pq->level_bits);
+    node_t *t = hi->tail, *h = get_head(hi), *x, *y;
+    int i;
+
+    assert(!pq->bound && !pq->insbuf);
+    hi->reuse = pq->reuse;
+    hi->hook_id = pq->hook_id;
+    if ((hi->block = pq->block))
+        hi->locals = calloc(PQ_MAX_LOCALS, sizeof *hi->locals);
+
+    op_enter();
+    for (x = get_head(pq); is_marked_ref(get_next(x, 0)); ) {
+        x = get_unmarked_ref(get_next(x, 0));
+        x->level = -x->level;
+    }
+    /* one descent, each level goes on from the last node before the
+     * cut on the level above */
+    x = get_head(pq);
+    for (i = NUM_LEVELS - 1; i >= 0; i--) {
+        while ((y = get_unmarked_ref(get_next(x, i))) != pq->tail &&
+               (y->level < 0 || y->k < k))
+            x = y;
+        set_next(h, i, y);
+        /* only the last deleted node is before the cut at level 0,
+         * and its next pointer is not marked */
+        set_next(x, i, t);
+    }
+    for (x = get_head(pq); is_marked_ref(get_next(x, 0)); ) {
+        x = get_unmarked_ref(get_next(x, 0));
+        x->level = -x->level;
+    }
+    hi->tail = pq->tail;
+    h->v = (pval_t) hi->tail;
+    pq->tail = t;
+    get_head(pq)->v = (pval_t) t;
+    op_exit();
+
+    /* a readable eventfd of its own, if it has elements */
+    if (pq->efd >= 0) {
+        E(pq_eventfd(hi));
+        if (get_next(h, 0) != hi->tail)
+            notify(hi);
+    }
+    return hi;
+}
+
 /* Cleanup, mark all the nodes for recycling. */
 void
 pq_destroy(pq_t *pq)
 {
     node_t *cur, *pred;
-    cur = pq->head;
+    /* also sets up the thread state, if this thread has none yet */
+    critical_enter();
+    cur = get_unmarked_ref(get_next(get_head(pq), 0));
     while (cur != pq->tail) {
         pred = cur;
-        cur = get_unmarked_ref(pred->next[0]);
-        free_node(pred);
+        cur = get_unmarked_ref(get_next(pred, 0));
+        /* quiesced, links can go straight back to their owner */
+        if (pq->reuse)
+            pq->reuse((pq_link_t *)pred);
+        else
+            free_node(pq, pred);
+    }
+    critical_exit();
+    /* buffered elements are dropped with the queue */
+    for (int i = 0; i < atomic_load(&pq->nlocals); i++) {
+        void *e = atomic_load(&pq->locals[i]);
+        if (e && pq->insbuf)
+            pq_destroy(((insbuf_t *)e)->stage);
+        free(e);
     }
+    free(pq->locals);
+    if (pq->efd >= 0)
+        close(pq->efd);
     free(pq->tail);
-    free(pq->head);
+    free(get_head(pq));
     free(pq);
 }
 
@@ -2,6 +2,7 @@
 #define PRIOQ_H
 
 #include "common.h"
+#include "stats.h"
 
 typedef unsigned long pkey_t;
 typedef void         *pval_t;
@@ -17,21 +18,79 @@ typedef struct node_s
 {
     pkey_t    k;
     int       level;
-    int       inserting; //char pad2[4];
+    _Atomic int inserting; //char pad2[4];
     pval_t    v;
-    struct node_s *next[1];
+    struct node_s *_Atomic next[1];
 } node_t;
 
+/* Intrusive queues link caller-owned objects. A pq_link_t is embedded
+ * in the object, and limits its node to PQ_LINK_LEVELS levels. */
+#define PQ_LINK_LEVELS 8
+
+typedef struct
+{
+    node_t  n;
+    node_t *_Atomic more_next[PQ_LINK_LEVELS - 1];
+} pq_link_t;
+
+/* Called when a deleted link can be reused. */
+typedef void (*pq_reuse_fn_t)(pq_link_t *l);
+
 typedef struct
 {
     int    max_offset;
     int    max_level;
+    int    level_bits; /* node level probability is 2^-level_bits */
+    pq_reuse_fn_t reuse; /* intrusive queue, if not NULL */
+    int    hook_id;
     int    nthreads;
-    node_t *head;
+    node_t *_Atomic head; /* replaced by pq_clear() */
+    _Atomic unsigned long clears; /* pq_clear() calls so far */
     node_t *tail;
+    /* bounded queue, see pq_init_bounded(); bound is 0 if unbounded */
+    unsigned long bound;
+    _Atomic long  count;      /* approximate number of live nodes */
+    _Atomic pkey_t threshold; /* inserts of larger keys are rejected */
+    _Atomic unsigned long gate; /* operations in progress, trim flag */
+    /* readiness eventfd, see pq_eventfd(); -1 if none */
+    int           efd;
+    _Atomic int   armed;      /* next insert is to write efd */
+    unsigned long serial;     /* tells queues at the same address apart */
+    /* per-thread state of relaxed and buffered queues */
+    _Atomic int   nlocals;
+    void *_Atomic *locals;
+    /* relaxed queue, see pq_init_relaxed(); block is 0 if exact */
+    int           block;
+    _Atomic pkey_t frontier;  /* largest key of the latest claim */
+    _Atomic unsigned long front_inserts; /* inserts below frontier */
+    /* buffered queue, see pq_init_buffered(); insbuf is 0 if none */
+    int           insbuf;
     char   pad[128];
 } pq_t;
 
+/* Operations a session runs before it lets the GC epoch move on. */
+#ifndef PQ_SESSION_OPS
+#define PQ_SESSION_OPS 128
+#endif
+
+/* Shape of the skiplist, see pq_shape_report(). */
+#define SHAPE_MAX_POOLS 32
+
+typedef struct
+{
+    unsigned long live;                  /* non-deleted nodes */
+    unsigned long level_hist[NUM_LEVELS]; /* live nodes of each level */
+    /* deleted nodes at level i from head->next[i] to the first live one */
+    unsigned long prefix[NUM_LEVELS];
+    /* bottom level nodes from where head->next[i] points to the first
+     * live node, i.e., how far head->next[i] lags behind */
+    unsigned long lag[NUM_LEVELS];
+    unsigned long inserting;             /* nodes with inserting set */
+    int           npools;
+    unsigned int  pool_blk_size[SHAPE_MAX_POOLS];
+    unsigned long pool_heap_size[SHAPE_MAX_POOLS];
+} pq_shape_t;
+
 #define get_marked_ref(_p)      ((void *)(((uintptr_t)(_p)) | 1))
 #define get_unmarked_ref(_p)    ((void *)(((uintptr_t)(_p)) & ~1))
 #define is_marked_ref(_p)       (((uintptr_t)(_p)) & 1)
@@ -39,14 +98,130 @@ typedef struct
 
 /* Interface */
 
+/* Returns NULL, with errno ENOSPC, if the GC's table of allocators or
+ * of hooks is full, see gc_add_allocator(); so do the other inits. */
 extern pq_t *pq_init(int max_offset);
 
+/* Queue with branching factor 2^level_bits, level_bits in 1..3. Fewer
+ * levels use less memory per node, at the cost of longer descents. */
+extern pq_t *pq_init_branching(int max_offset, int level_bits);
+
+/* Intrusive queue, only to be used with the pq_link_ functions.
+ * Deleted links are passed to reuse by the GC of the thread that
+ * deleted them, some epochs later, also after pq_destroy() has
+ * returned. A link, and whatever reuse touches, must stay valid until
+ * reuse has been called on it. pq_destroy() passes the links still in
+ * the queue to reuse at once. */
+extern pq_t *pq_init_intrusive(int max_offset, pq_reuse_fn_t reuse);
+
+/* Queue keeping only about the bound smallest keys. Inserts of keys
+ * at or above the bound-th smallest are rejected without allocating,
+ * and the largest nodes are trimmed when the queue holds more than
+ * bound + bound/8 + 1 of them. Operations on a bounded queue wait
+ * while a trim is in progress. */
+extern pq_t *pq_init_bounded(int max_offset, unsigned long bound);
+
+/* Threads that may keep state in one relaxed or buffered queue. */
+#define PQ_MAX_LOCALS 256
+
+/* Relaxed queue. A deletemin claims up to block of the smallest
+ * elements at once into a buffer of the calling thread in pq, and
+ * later deletemins of the thread from pq are served from it, until an
+ * insert of a smaller key than the latest claim makes it stale. An
+ * element is then at most about nthreads * block places from the
+ * minimum. Deletemins of threads beyond the first PQ_MAX_LOCALS are
+ * exact. */
+#define PQ_BLOCK_MAX 64
+extern pq_t *pq_init_relaxed(int max_offset, int block);
+
+/* Put the elements of the calling thread's buffer in pq back into
+ * pq. To be called before a thread that used a relaxed queue exits,
+ * or stops using it. Returns the number of elements left in the
+ * buffer, as their keys have been inserted again meanwhile; call
+ * again once those have been deleted. */
+extern int pq_cache_flush(pq_t *pq);
+
+/* Buffered queue. Inserts go to a heap of up to insbuf elements of
+ * the inserting thread, which is spliced into the queue as one sorted
+ * run when full. Deletemin takes the minimum of a buffer instead of
+ * that of the queue when it is smaller, so buffered elements are not
+ * starved. Buffers belong to the queue, one per thread, and are freed
+ * with it. Inserts of threads beyond the first PQ_MAX_LOCALS go
+ * straight into the queue. */
+#define PQ_INSBUF_MAX 1024
+extern pq_t *pq_init_buffered(int max_offset, int insbuf);
+
+/* Splice the calling thread's buffer into pq now. */
+extern void pq_insert_flush(pq_t *pq);
+
+/* Free the queue. Must not be in use. For intrusive queues, see
+ * pq_init_intrusive() on reuse callbacks that are still pending. */
 extern void pq_destroy(pq_t *pq);
 
+/* Empty the queue in constant time, by replacing its head. The old
+ * nodes are reclaimed lazily, by the GC. Operations running
+ * concurrently with the clear may still see the old nodes; an insert
+ * that lands among them takes effect before the clear, and is
+ * dropped. Elements in insert buffers and in claimed relaxed blocks
+ * are dropped too. Not for intrusive queues. */
+extern void pq_clear(pq_t *pq);
+
+/* Move all elements of src into dst, reusing their nodes, and leave
+ * src empty. Keys already in dst are dropped. dst may be in use
+ * concurrently, src must not be. Not for intrusive or bounded
+ * queues. */
+extern void pq_meld(pq_t *dst, pq_t *src);
+
+/* Move the elements with keys at or above k into a new queue, which
+ * is returned, by cutting each level of pq at k. pq must not be in
+ * use. The new queue is of the same kind, and gets an eventfd of its
+ * own, in its efd field, if pq has one. Not for bounded or buffered
+ * queues. */
+extern pq_t *pq_split(pq_t *pq, pkey_t k);
+
 extern void insert(pq_t *pq, pkey_t k, pval_t v);
 
 extern pval_t deletemin(pq_t *pq);
 
-extern void sequential_length(pq_t *pq);
+/* Create an eventfd that becomes readable when an element is inserted
+ * into the empty queue, for use with poll/epoll. Consumers delete with
+ * pq_eventfd_deletemin(), until it returns NULL. Returns the fd, or -1
+ * with errno set. Call once, before the queue is shared. */
+extern int pq_eventfd(pq_t *pq);
+
+/* As deletemin(), but when the queue is found empty the eventfd is
+ * reset and armed for the next insert. */
+extern pval_t pq_eventfd_deletemin(pq_t *pq);
+
+/* Insert link l with key k. Returns 0, leaving l unused, if k is
+ * already present. */
+extern int pq_link_insert(pq_t *pq, pq_link_t *l, pkey_t k);
+
+/* Delete the link with the smallest key, NULL if empty. The link must
+ * not be reinserted until it has been passed to the reuse callback. */
+extern pq_link_t *pq_link_deletemin(pq_t *pq);
+
+/* Run the following operations of this thread, on any queue, in a
+ * shared GC critical section, until pq_session_end(). Every
+ * PQ_SESSION_OPS operations, the section is left and entered again at
+ * the start of the operation, so a node or link returned by an
+ * operation, e.g. by pq_link_deletemin(), is only protected until the
+ * thread's next operation, not until the end of the session. Sessions
+ * nest. No other blocking or long-running work should be done inside
+ * a session. */
+extern void pq_session_begin(void);
+extern void pq_session_end(void);
+
+extern unsigned long pq_prefix_length(pq_t *pq);
+
+/* Sum of the operation counters of all threads. All zero unless
+ * built with PQ_STATS. The counters are per thread, not per queue. */
+extern void pq_stats_snapshot(pq_stats_t *s);
+
+/* Walk the whole queue and describe its shape. Safe on a live queue,
+ * in which case the result is approximate. */
+extern void pq_shape_report(pq_t *pq, pq_shape_t *s);
+
+extern void pq_shape_print(FILE *out, pq_shape_t *s);
 
 #endif // PRIOQ_H
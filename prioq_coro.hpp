@@ -0,0 +1,163 @@
+#ifndef PRIOQ_CORO_HPP
+#define PRIOQ_CORO_HPP
+
+/* C++20 coroutine interface of the queue.
+ *
+ *     pq_async q(32);
+ *     q.push(k, v);
+ *     void *v = co_await q.pop();
+ *
+ * pop() completes at once if an element can be deleted. Otherwise
+ * the coroutine is put on a lock-free list of waiters, and stays
+ * suspended, using no CPU, until a push() hands it an element. A
+ * waiter is resumed on the thread that pushed, or passed to the
+ * scheduler given to the constructor. try_pop() is plain deletemin().
+ *
+ * Only elements pushed through push() wake waiters. Values must not
+ * be NULL, as for deletemin(). Waiters must be gone before the queue
+ * is destroyed. The GC subsystem must have been initialised.
+ *
+ * prioq.h is C11 and cannot be included here, so the few functions
+ * needed are declared on an opaque queue type.
+ */
+
+#include <atomic>
+#include <coroutine>
+#include <functional>
+
+extern "C" {
+    struct pq_t;
+    pq_t *pq_init(int max_offset);
+    void  pq_destroy(pq_t *pq);
+    void  insert(pq_t *pq, unsigned long k, void *v);
+    void *deletemin(pq_t *pq);
+}
+
+class pq_async
+{
+    /* Lives in the frame of the waiting coroutine. A waker takes the
+     * whole list, so a waiter is handled by one thread at a time. */
+    struct waiter
+    {
+        std::coroutine_handle<> h;
+        void   *v;
+        waiter *next;
+    };
+
+public:
+    using scheduler_t = std::function<void(std::coroutine_handle<>)>;
+
+    explicit pq_async(int max_offset, scheduler_t sched = nullptr)
+        : pq_(pq_init(max_offset)), sched_(std::move(sched)) {}
+    ~pq_async() { pq_destroy(pq_); }
+
+    pq_async(const pq_async &) = delete;
+    pq_async &operator=(const pq_async &) = delete;
+
+    void push(unsigned long k, void *v)
+    {
+        insert(pq_, k, v);
+        inserts_.fetch_add(1);
+        if (waiter *w = wake_one())
+            resume(w->h);
+    }
+
+    void *try_pop() { return deletemin(pq_); }
+
+    class pop_awaiter
+    {
+        pq_async *q_;
+        void     *v_ = nullptr;
+        waiter    w_;
+
+    public:
+        explicit pop_awaiter(pq_async *q) : q_(q) {}
+
+        bool await_ready() { return (v_ = deletemin(q_->pq_)) != nullptr; }
+
+        /* Once w_ is on the list, another thread may resume the
+         * coroutine and end this awaiter, so only locals are used
+         * after the push. */
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<> h)
+        {
+            pq_async *q = q_;
+            waiter *self = &w_, *w;
+
+            w_.h = h;
+            q->push_waiters(self, self);
+            /* an element may have come before the push */
+            w = q->wake_one();
+            if (w == self)
+                return h;
+            if (w && !q->sched_)
+                return w->h;
+            if (w)
+                q->sched_(w->h);
+            return std::noop_coroutine();
+        }
+
+        void *await_resume() { return v_ ? v_ : w_.v; }
+    };
+
+    pop_awaiter pop() { return pop_awaiter(this); }
+
+private:
+    pq_t                 *pq_;
+    scheduler_t           sched_;
+    std::atomic<waiter *> waiters_{nullptr};
+    /* pushes so far, tells a waker that found no element whether one
+     * may have come in while it held the list */
+    std::atomic<unsigned long> inserts_{0};
+
+    void push_waiters(waiter *first, waiter *last)
+    {
+        waiter *old = waiters_.load(std::memory_order_relaxed);
+        do {
+            last->next = old;
+        } while (!waiters_.compare_exchange_weak(old, first));
+    }
+
+    /* Take a waiter and an element for it. The fences order the
+     * insert, or the push of a waiter, before the look at the other
+     * side. */
+    waiter *wake_one()
+    {
+        waiter *w, *last;
+        unsigned long c;
+        void *v;
+
+        for (;;) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            c = inserts_.load();
+            if (!waiters_.load() || !(w = waiters_.exchange(nullptr)))
+                return nullptr;
+            if (w->next) {
+                waiter *rest = w->next, *none = nullptr;
+                if (!waiters_.compare_exchange_strong(none, rest)) {
+                    for (last = rest; last->next; last = last->next) ;
+                    push_waiters(rest, last);
+                }
+            }
+            if ((v = deletemin(pq_))) {
+                w->v = v;
+                return w;
+            }
+            /* the element went to a try_pop() or a ready pop() */
+            push_waiters(w, w);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (inserts_.load() == c)
+                return nullptr;
+        }
+    }
+
+    void resume(std::coroutine_handle<> h)
+    {
+        if (sched_)
+            sched_(h);
+        else
+            h.resume();
+    }
+};
+
+#endif // PRIOQ_CORO_HPP
@@ -0,0 +1,501 @@
+/*************************************************************************
+ * prioq_fat.c
+ *
+ * Concurrent priority queue, unrolled (fat node) build.
+ *
+ * Copyright (c) 2012-2018, Jonatan Linden
+ *
+ * The skiplist algorithm is the one of prioq.c, see there for the
+ * details and the license. Here, skiplist nodes carry up to PQF_KEYS
+ * keys each, see prioq_fat.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "gc/ptst.h"
+#include "common.h"
+#include "prioq_fat.h"
+
+extern __thread ptst_t *ptst;
+
+/* Orderings as in prioq.c. */
+#define get_next(_n, _i)                                                \
+    atomic_load_explicit(&(_n)->next[_i], memory_order_acquire)
+#define get_next_rlx(_n, _i)                                            \
+    atomic_load_explicit(&(_n)->next[_i], memory_order_relaxed)
+#define set_next(_n, _i, _v)                                            \
+    atomic_store_explicit(&(_n)->next[_i], (_v), memory_order_relaxed)
+#define cas_next(_n, _i, _o, _v, _mo)                                   \
+    ({ pqf_node_t *__o = (_o);                                          \
+       atomic_compare_exchange_strong_explicit(&(_n)->next[_i], &__o,   \
+           (_v), (_mo), memory_order_relaxed); })
+#define get_inserting(_n)                                               \
+    atomic_load_explicit(&(_n)->inserting, memory_order_acquire)
+#define clear_inserting(_n)                                             \
+    atomic_store_explicit(&(_n)->inserting, 0, memory_order_release)
+
+/* Keys and values are written under the node lock, and read
+ * optimistically by deletemin, which validates with the state CAS. */
+#define get_val(_n, _i)                                                 \
+    atomic_load_explicit((_Atomic pval_t *)&(_n)->vals[_i], memory_order_relaxed)
+#define set_key(_n, _i, _k)                                             \
+    atomic_store_explicit((_Atomic pkey_t *)&(_n)->keys[_i], (_k), memory_order_relaxed)
+#define set_val(_n, _i, _v)                                             \
+    atomic_store_explicit((_Atomic pval_t *)&(_n)->vals[_i], (_v), memory_order_relaxed)
+
+/* Node state word: lock, dead, first live key, key count, version. */
+#define ST_LOCK         1UL
+#define ST_DEAD         2UL
+#define ST_START(_s)    ((int)(((_s) >> 2) & 0xff))
+#define ST_CNT(_s)      ((int)(((_s) >> 10) & 0xff))
+#define ST_VER(_s)      ((_s) >> 18)
+#define ST_ONE_START    (1UL << 2)
+#define ST_MAKE(_ver, _cnt, _start)                                     \
+    (((uint64_t)(_ver) << 18) | ((uint64_t)(_cnt) << 10) |              \
+     ((uint64_t)(_start) << 2))
+
+#define get_state(_n)                                                   \
+    atomic_load_explicit(&(_n)->state, memory_order_acquire)
+#define cas_state(_n, _o, _v)                                           \
+    ({ uint64_t __o = (_o);                                             \
+       atomic_compare_exchange_strong_explicit(&(_n)->state, &__o, (_v), \
+           memory_order_acq_rel, memory_order_relaxed); })
+
+#if defined(__x86_64__)
+#define cpu_relax() __asm__ __volatile__ ("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__ ("yield" ::: "memory")
+#endif
+
+
+/***** in-node search *****
+ * Number of live keys, in slots [start, cnt), smaller than k, and
+ * whether k is among them.
+ */
+static int
+rank_scalar(pqf_node_t *n, int start, int cnt, pkey_t k, int *eq)
+{
+    int r = 0;
+
+    *eq = 0;
+    for (int i = start; i < cnt; i++) {
+        r += n->keys[i] < k;
+        *eq |= n->keys[i] == k;
+    }
+    return r;
+}
+
+#if defined(__x86_64__)
+/* Unsigned compares, by flipping the sign bits for the signed
+ * _mm256_cmpgt_epi64. Slots outside [start, cnt) are masked off. The
+ * loads are unaligned, as GC blocks are only 8-aligned. */
+__attribute__((target("avx2"))) static int
+rank_avx2(pqf_node_t *n, int start, int cnt, pkey_t k, int *eq)
+{
+    const __m256i bias = _mm256_set1_epi64x((long long) (1UL << 63));
+    __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x((long long) k), bias);
+    __m256i a  = _mm256_loadu_si256((__m256i *) &n->keys[0]);
+    __m256i b  = _mm256_loadu_si256((__m256i *) &n->keys[4]);
+    __m256i ab = _mm256_xor_si256(a, bias);
+    __m256i bb = _mm256_xor_si256(b, bias);
+    unsigned int lt, e, live;
+
+    lt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(kv, ab))) |
+        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(kv, bb))) << 4;
+    e = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(kv, ab))) |
+        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(kv, bb))) << 4;
+    live = ((1u << cnt) - 1) & ~((1u << start) - 1);
+    *eq = (e & live) != 0;
+    return __builtin_popcount(lt & live);
+}
+#endif
+
+static int (*rank)(pqf_node_t *n, int start, int cnt, pkey_t k, int *eq)
+    = rank_scalar;
+
+
+static inline int
+random_level(void)
+{
+    unsigned int r = ptst->rand;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    ptst->rand = r;
+    return __builtin_ctz(r | (1u << (NUM_LEVELS - 1))) + 1;
+}
+
+static pqf_node_t *
+alloc_node(pqf_t *pq)
+{
+    pqf_node_t *n;
+    int level = random_level();
+
+    n = gc_alloc(ptst, pq->gc_id[level - 1]);
+    n->level = level;
+    atomic_init(&n->inserting, level > 1);
+    memset(n->next, 0, level * sizeof(pqf_node_t *));
+    return n;
+}
+
+static void
+free_node(pqf_t *pq, pqf_node_t *n)
+{
+    gc_free(ptst, (void *)n, pq->gc_id[n->level - 1]);
+}
+
+
+/* See locate_preds() of prioq.c. Nodes are ordered by low key. */
+static pqf_node_t *
+locate_preds(pqf_t * restrict pq, pkey_t k, pqf_node_t ** restrict preds,
+             pqf_node_t ** restrict succs)
+{
+    pqf_node_t *x, *x_next, *del = NULL;
+    int d, i;
+
+    x = pq->head;
+    i = NUM_LEVELS - 1;
+    while (i >= 0)
+    {
+        x_next = get_next(x, i);
+        d = is_marked_ref(x_next);
+        x_next = get_unmarked_ref(x_next);
+
+        while (x_next->k < k || is_marked_ref(get_next_rlx(x_next, 0))
+               || ((i == 0) && d)) {
+            if (i == 0 && d)
+                del = x_next;
+            x = x_next;
+            x_next = get_next(x, i);
+            d = is_marked_ref(x_next);
+            x_next = get_unmarked_ref(x_next);
+        }
+        preds[i] = x;
+        succs[i] = x_next;
+        i--;
+    }
+    return del;
+}
+
+
+/* See insert_node() of prioq.c. A drained node does not count as a
+ * duplicate low key; the new node goes in before it. */
+static int
+insert_node(pqf_t *pq, pqf_node_t *new)
+{
+    pqf_node_t *preds[NUM_LEVELS], *succs[NUM_LEVELS];
+    pqf_node_t *del;
+    pkey_t k = new->k;
+
+ retry:
+    del = locate_preds(pq, k, preds, succs);
+
+    if (succs[0]->k == k && get_next(preds[0], 0) == succs[0] &&
+        !(get_state(succs[0]) & ST_DEAD)) {
+        clear_inserting(new);
+        return 0;
+    }
+    set_next(new, 0, succs[0]);
+
+    if (!cas_next(preds[0], 0, succs[0], new, memory_order_release))
+        goto retry;
+
+    int i = 1;
+    while (i < new->level)
+    {
+        if (is_marked_ref(get_next_rlx(new, 0)) ||
+            is_marked_ref(get_next_rlx(succs[i], 0)) ||
+            del == succs[i])
+            break;
+
+        set_next(new, i, succs[i]);
+        if (!cas_next(preds[i], i, succs[i], new, memory_order_release))
+        {
+            del = locate_preds(pq, k, preds, succs);
+            if (succs[0] != new) break;
+        } else {
+            i++;
+        }
+    }
+    clear_inserting(new);
+    return 1;
+}
+
+
+/* Add k to the locked node n, with state s, and unlock it. A full node
+ * is split, and the upper half linked in before n is unlocked, so that
+ * its keys are never out of reach of deletemin. Returns 0, with n
+ * unlocked and unchanged, if the upper half cannot be linked in, as a
+ * live node has its low key already; the insert then starts over. */
+static int
+node_add(pqf_t *pq, pqf_node_t *n, uint64_t s, pkey_t k, pval_t v)
+{
+    pkey_t keys[PQF_KEYS + 1];
+    pval_t vals[PQF_KEYS + 1];
+    int start = ST_START(s), cnt = ST_CNT(s), live = cnt - start;
+    int pos, eq, i, j, h;
+    pqf_node_t *m;
+
+    pos = rank(n, start, cnt, k, &eq);
+    if (eq) {
+        atomic_store_explicit(&n->state, s, memory_order_release);
+        return 1;
+    }
+
+    for (i = start, j = 0; j <= live; j++) {
+        if (j == pos) {
+            keys[j] = k;
+            vals[j] = v;
+        } else {
+            keys[j] = n->keys[i];
+            vals[j] = n->vals[i];
+            i++;
+        }
+    }
+    live++;
+
+    h = live;
+    if (live > PQF_KEYS) {
+        h = live / 2;
+        m = alloc_node(pq);
+        m->k = keys[h];
+        for (j = h; j < live; j++) {
+            m->keys[j - h] = keys[j];
+            m->vals[j - h] = vals[j];
+        }
+        atomic_init(&m->state, ST_MAKE(0, live - h, 0));
+        if (!insert_node(pq, m)) {
+            free_node(pq, m);
+            atomic_store_explicit(&n->state, s, memory_order_release);
+            return 0;
+        }
+    }
+
+    for (j = 0; j < h; j++) {
+        set_key(n, j, keys[j]);
+        set_val(n, j, vals[j]);
+    }
+    atomic_store_explicit(&n->state, ST_MAKE(ST_VER(s) + 1, h, 0),
+                          memory_order_release);
+    return 1;
+}
+
+
+void
+pqf_insert(pqf_t *pq, pkey_t k, pval_t v)
+{
+    pqf_node_t *preds[NUM_LEVELS], *succs[NUM_LEVELS], *n, *nx;
+    uint64_t s;
+
+    assert(SENTINEL_KEYMIN < k && k < SENTINEL_KEYMAX);
+    critical_enter();
+
+ retry:
+    locate_preds(pq, k, preds, succs);
+    n = preds[0];
+    /* the node with low key k owns k */
+    if (succs[0]->k == k && get_next(preds[0], 0) == succs[0])
+        n = succs[0];
+    if (n == pq->head) goto new_node;
+
+    for (;;) {
+        s = get_state(n);
+        if (s & ST_DEAD) goto new_node;
+        if (s & ST_LOCK) {
+            cpu_relax();
+            continue;
+        }
+        if (cas_state(n, s, s | ST_LOCK)) break;
+    }
+
+    /* a split may have moved k's range to a new successor */
+    nx = get_unmarked_ref(get_next(n, 0));
+    if (nx != pq->tail && nx->k <= k) {
+        atomic_store_explicit(&n->state, s, memory_order_release);
+        goto retry;
+    }
+    if (!node_add(pq, n, s, k, v))
+        goto retry;
+    goto out;
+
+ new_node:
+    n = alloc_node(pq);
+    n->k = k;
+    n->keys[0] = k;
+    n->vals[0] = v;
+    atomic_init(&n->state, ST_MAKE(0, 1, 0));
+    if (!insert_node(pq, n)) {
+        free_node(pq, n);
+        goto retry;
+    }
+ out:
+    critical_exit();
+}
+
+
+/* See restructure() of prioq.c. */
+static void
+restructure(pqf_t *pq)
+{
+    pqf_node_t *pred, *cur, *h;
+    int i = NUM_LEVELS - 1;
+
+    pred = pq->head;
+    while (i > 0) {
+        h = get_next(pq->head, i);
+        cur = get_next(pred, i);
+        if (!is_marked_ref(get_next_rlx(h, 0))) {
+            i--;
+            continue;
+        }
+        while (is_marked_ref(get_next_rlx(cur, 0))) {
+            pred = cur;
+            cur = get_next(pred, i);
+        }
+        if (cas_next(pq->head, i, h, cur, memory_order_release))
+            i--;
+    }
+}
+
+
+/* deletemin
+ *
+ * Walk past the deleted nodes to the first live one, and take its
+ * first live key. A drained node is set dead, and then deleted as in
+ * prioq.c, by marking the pointer leading to it. That pointer is
+ * CASed rather than or-ed, since a node with smaller keys may have
+ * been linked in before the drained one.
+ */
+pval_t
+pqf_deletemin(pqf_t *pq)
+{
+    pqf_node_t *x, *y, *nxt, *obs_head, *newhead = NULL, *cur;
+    pval_t v = NULL;
+    uint64_t s;
+    int offset = 0, i;
+
+    critical_enter();
+
+    x = pq->head;
+    obs_head = get_next(x, 0);
+
+    for (;;) {
+        nxt = get_next(x, 0);
+        y = get_unmarked_ref(nxt);
+        if (y == pq->tail)
+            goto out;
+
+        if (newhead == NULL && get_inserting(x)) newhead = x;
+
+        if (is_marked_ref(nxt)) {
+            offset++;
+            x = y;
+            continue;
+        }
+
+        s = get_state(y);
+        if (s & ST_LOCK) {
+            cpu_relax();
+            continue;
+        }
+        i = ST_START(s);
+        if (!(s & ST_DEAD) && i < ST_CNT(s)) {
+            v = get_val(y, i);
+            if (cas_state(y, s, s + ST_ONE_START))
+                break;
+            continue;
+        }
+        if (!(s & ST_DEAD) && !cas_state(y, s, s | ST_DEAD))
+            continue;
+        if (cas_next(x, 0, y, get_marked_ref(y), memory_order_acq_rel)) {
+            offset++;
+            x = y;
+        }
+    }
+
+    /* x is the last deleted node passed, or the head */
+    if (x == pq->head) goto out;
+    if (newhead == NULL) newhead = x;
+
+    if (offset <= pq->max_offset) goto out;
+    if (get_next_rlx(pq->head, 0) != obs_head) goto out;
+
+    if (cas_next(pq->head, 0, obs_head, get_marked_ref(newhead),
+                 memory_order_acq_rel))
+    {
+        restructure(pq);
+        cur = get_unmarked_ref(obs_head);
+        while (cur != newhead) {
+            nxt = get_unmarked_ref(get_next_rlx(cur, 0));
+            assert(is_marked_ref(get_next_rlx(cur, 0)));
+            free_node(pq, cur);
+            cur = nxt;
+        }
+    }
+ out:
+    critical_exit();
+    return v;
+}
+
+
+pqf_t *
+pqf_init(int max_offset)
+{
+    pqf_node_t *h, *t;
+    size_t sz = sizeof *h + (NUM_LEVELS - 1) * sizeof(pqf_node_t *);
+    pqf_t *pq;
+    int i;
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        rank = rank_avx2;
+#endif
+
+    E_NULL(pq = malloc(sizeof *pq));
+    for (i = 0; i < NUM_LEVELS; i++)
+        if ((pq->gc_id[i] = gc_add_allocator(sizeof *h +
+                                             i * sizeof(pqf_node_t *))) < 0) {
+            free(pq);
+            errno = ENOSPC;
+            return NULL;
+        }
+    E_NULL(h = calloc(1, sz));
+    E_NULL(t = calloc(1, sz));
+    h->k = SENTINEL_KEYMIN;
+    t->k = SENTINEL_KEYMAX;
+    h->level = t->level = NUM_LEVELS;
+    atomic_init(&h->state, ST_DEAD);
+    atomic_init(&t->state, ST_DEAD);
+    for (i = 0; i < NUM_LEVELS; i++)
+        atomic_init(&h->next[i], t);
+
+    pq->head = h;
+    pq->tail = t;
+    pq->max_offset = max_offset;
+
+    return pq;
+}
+
+void
+pqf_destroy(pqf_t *pq)
+{
+    pqf_node_t *cur, *pred;
+
+    critical_enter();
+    cur = get_unmarked_ref(get_next(pq->head, 0));
+    while (cur != pq->tail) {
+        pred = cur;
+        cur = get_unmarked_ref(get_next(pred, 0));
+        free_node(pq, pred);
+    }
+    critical_exit();
+    free(pq->tail);
+    free(pq->head);
+    free(pq);
+}
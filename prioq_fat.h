@@ -0,0 +1,54 @@
+#ifndef PRIOQ_FAT_H
+#define PRIOQ_FAT_H
+
+#include "prioq.h"
+
+/* Unrolled (fat node) build of the queue.
+ *
+ * Each skiplist node holds up to PQF_KEYS sorted keys. The node is
+ * routed by its low key, fixed at creation, and owns the keys from
+ * there up to the low key of its bottom level successor. A descent
+ * thus visits one node per PQF_KEYS keys.
+ *
+ * The state word of a node holds the index of its first live key,
+ * its key count, a lock bit, a dead bit and a version. Deletemin
+ * consumes keys from the front node by advancing the index with a
+ * CAS, and marks the node deleted, as in prioq.c, once it is drained.
+ * Inserts into a node take its lock bit, so they serialise with each
+ * other and hold back deletemin on that node; descents never wait.
+ * A full node is split, and the new upper half linked in with the
+ * insert of prioq.c. */
+
+#define PQF_KEYS 8
+
+typedef struct pqf_node_s
+{
+    pkey_t      k;       /* low key, the routing key */
+    int         level;
+    _Atomic int inserting;
+    _Atomic uint64_t state;
+    pkey_t      keys[PQF_KEYS]; /* 8-aligned only, see rank_avx2() */
+    pval_t      vals[PQF_KEYS];
+    struct pqf_node_s *_Atomic next[1];
+} pqf_node_t;
+
+typedef struct
+{
+    int          max_offset;
+    int          gc_id[NUM_LEVELS];
+    pqf_node_t  *head;
+    pqf_node_t  *tail;
+    char         pad[128];
+} pqf_t;
+
+/* Returns NULL, with errno ENOSPC, if the GC's table of allocators is
+ * full. */
+extern pqf_t *pqf_init(int max_offset);
+
+extern void pqf_destroy(pqf_t *pq);
+
+extern void pqf_insert(pqf_t *pq, pkey_t k, pval_t v);
+
+extern pval_t pqf_deletemin(pqf_t *pq);
+
+#endif // PRIOQ_FAT_H
@@ -0,0 +1,305 @@
+/*************************************************************************
+ * prioq_idx.c
+ *
+ * Lock-free concurrent priority queue, compact index build.
+ *
+ * Copyright (c) 2012-2018, Jonatan Linden
+ *
+ * The algorithm is the one of prioq.c, see there for the details and
+ * the license. Only the representation of next pointers differs: a
+ * pqi_ref_t is a 32-bit reference into the queue's node arena, marked
+ * in bit 0 like the pointers of prioq.c.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "gc/ptst.h"
+#include "common.h"
+#include "prioq_idx.h"
+
+extern __thread ptst_t *ptst;
+
+#define node(_pq, _r)                                                   \
+    ((pqi_node_t *)((_pq)->arena->base + ((size_t)((_r) >> 1) << 3)))
+#define ref(_pq, _n)                                                    \
+    ((pqi_ref_t)((((char *)(_n) - (_pq)->arena->base) >> 3) << 1))
+
+#define is_marked(_r)  ((_r) & 1)
+#define unmarked(_r)   ((_r) & ~1u)
+#define marked(_r)     ((_r) | 1)
+
+/* Orderings as in prioq.c. */
+#define get_next(_n, _i)                                                \
+    atomic_load_explicit(&(_n)->next[_i], memory_order_acquire)
+#define get_next_rlx(_n, _i)                                            \
+    atomic_load_explicit(&(_n)->next[_i], memory_order_relaxed)
+#define set_next(_n, _i, _v)                                            \
+    atomic_store_explicit(&(_n)->next[_i], (_v), memory_order_relaxed)
+#define cas_next(_n, _i, _o, _v, _mo)                                   \
+    ({ pqi_ref_t __o = (_o);                                            \
+       atomic_compare_exchange_strong_explicit(&(_n)->next[_i], &__o,   \
+           (_v), (_mo), memory_order_relaxed); })
+
+/* Block size of a node of level _l, refs are in 8-byte units. */
+#define node_size(_l)                                                   \
+    ((offsetof(pqi_node_t, next) + (_l) * sizeof(pqi_ref_t) + 7) & ~7ul)
+
+
+static inline int
+random_level(pqi_t *pq)
+{
+    unsigned int r = ptst->rand;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    ptst->rand = r;
+    return __builtin_ctz(r | (1u << (NUM_LEVELS - 1))) / pq->level_bits + 1;
+}
+
+static pqi_node_t *
+alloc_node(pqi_t *pq)
+{
+    pqi_node_t *n;
+    int level = random_level(pq);
+
+    n = gc_alloc(ptst, pq->gc_id[level - 1]);
+    n->level = level;
+    atomic_init(&n->inserting, level > 1);
+    memset(n->next, 0, level * sizeof(pqi_ref_t));
+    return n;
+}
+
+static void
+free_node(pqi_t *pq, pqi_node_t *n)
+{
+    gc_free(ptst, (void *)n, pq->gc_id[n->level - 1]);
+}
+
+
+/* See locate_preds() of prioq.c. */
+static pqi_ref_t
+locate_preds(pqi_t * restrict pq, pkey_t k, pqi_ref_t * restrict preds,
+             pqi_ref_t * restrict succs)
+{
+    pqi_node_t *x;
+    pqi_ref_t x_next, xr, del = 0;
+    int d, i;
+
+    xr = pq->head;
+    x = node(pq, xr);
+    i = NUM_LEVELS - 1;
+    while (i >= 0)
+    {
+        x_next = get_next(x, i);
+        d = is_marked(x_next);
+        x_next = unmarked(x_next);
+        assert(x_next != 0);
+
+        while (node(pq, x_next)->k < k
+               || is_marked(get_next_rlx(node(pq, x_next), 0))
+               || ((i == 0) && d)) {
+            if (i == 0 && d)
+                del = x_next;
+            xr = x_next;
+            x = node(pq, xr);
+            x_next = get_next(x, i);
+            d = is_marked(x_next);
+            x_next = unmarked(x_next);
+            assert(x_next != 0);
+        }
+        preds[i] = xr;
+        succs[i] = x_next;
+        i--;
+    }
+    return del;
+}
+
+
+void
+pqi_insert(pqi_t *pq, pkey_t k, pval_t v)
+{
+    pqi_ref_t preds[NUM_LEVELS], succs[NUM_LEVELS], del, nr;
+    pqi_node_t *new, *p0;
+
+    assert(SENTINEL_KEYMIN < k && k < SENTINEL_KEYMAX);
+    critical_enter();
+
+    new    = alloc_node(pq);
+    new->k = k;
+    new->v = v;
+    nr     = ref(pq, new);
+
+ retry:
+    del = locate_preds(pq, k, preds, succs);
+    p0  = node(pq, preds[0]);
+
+    if (node(pq, succs[0])->k == k && get_next(p0, 0) == succs[0]) {
+        free_node(pq, new);
+        goto out;
+    }
+    set_next(new, 0, succs[0]);
+
+    if (!cas_next(p0, 0, succs[0], nr, memory_order_release))
+        goto retry;
+
+    int i = 1;
+    while (i < new->level)
+    {
+        if (is_marked(get_next_rlx(new, 0)) ||
+            is_marked(get_next_rlx(node(pq, succs[i]), 0)) ||
+            del == succs[i])
+            break;
+
+        set_next(new, i, succs[i]);
+        if (!cas_next(node(pq, preds[i]), i, succs[i], nr,
+                      memory_order_release))
+        {
+            del = locate_preds(pq, k, preds, succs);
+            if (succs[0] != nr) break;
+        } else {
+            i++;
+        }
+    }
+    atomic_store_explicit(&new->inserting, 0, memory_order_release);
+ out:
+    critical_exit();
+}
+
+
+/* See restructure() of prioq.c. */
+static void
+restructure(pqi_t *pq)
+{
+    pqi_node_t *head = node(pq, pq->head);
+    pqi_ref_t pred, cur, h;
+    int i = NUM_LEVELS - 1;
+
+    pred = pq->head;
+    while (i > 0) {
+        h = get_next(head, i);
+        cur = get_next(node(pq, pred), i);
+        if (!is_marked(get_next_rlx(node(pq, h), 0))) {
+            i--;
+            continue;
+        }
+        while (is_marked(get_next_rlx(node(pq, cur), 0))) {
+            pred = cur;
+            cur = get_next(node(pq, pred), i);
+        }
+        if (cas_next(head, i, h, cur, memory_order_release))
+            i--;
+    }
+}
+
+
+pval_t
+pqi_deletemin(pqi_t *pq)
+{
+    pqi_node_t *head = node(pq, pq->head), *x;
+    pqi_ref_t xr, nxt, obs_head, newhead = 0, cur;
+    pval_t v = NULL;
+    int offset = 0;
+
+    critical_enter();
+
+    xr = pq->head;
+    obs_head = get_next(head, 0);
+
+    do {
+        offset++;
+        x = node(pq, xr);
+        nxt = get_next(x, 0);
+
+        if (unmarked(nxt) == pq->tail)
+            goto out;
+
+        if (newhead == 0 && atomic_load_explicit(&x->inserting, memory_order_acquire))
+            newhead = xr;
+
+        if (is_marked(nxt)) continue;
+        nxt = atomic_fetch_or_explicit(&x->next[0], 1, memory_order_acq_rel);
+    }
+    while ((xr = unmarked(nxt)) && is_marked(nxt));
+
+    v = node(pq, xr)->v;
+
+    if (newhead == 0) newhead = xr;
+
+    if (offset <= pq->max_offset) goto out;
+    if (get_next_rlx(head, 0) != obs_head) goto out;
+
+    if (cas_next(head, 0, obs_head, marked(newhead), memory_order_acq_rel))
+    {
+        restructure(pq);
+
+        cur = unmarked(obs_head);
+        while (cur != newhead) {
+            x = node(pq, cur);
+            nxt = unmarked(get_next_rlx(x, 0));
+            assert(is_marked(get_next_rlx(x, 0)));
+            free_node(pq, x);
+            cur = nxt;
+        }
+    }
+ out:
+    critical_exit();
+    return v;
+}
+
+
+pqi_t *
+pqi_init(int max_offset, size_t arena_size)
+{
+    pqi_node_t *h, *t;
+    pqi_t *pq;
+    int i;
+
+    E_NULL(pq = malloc(sizeof *pq));
+    E_NULL(pq->arena = arena_create(arena_size));
+    pq->max_offset = max_offset;
+    pq->level_bits = 1;
+
+    /* the sentinels are never freed, take them off the arena directly */
+    E_NULL(h = arena_alloc(pq->arena, node_size(NUM_LEVELS)));
+    E_NULL(t = arena_alloc(pq->arena, node_size(NUM_LEVELS)));
+    memset(h, 0, node_size(NUM_LEVELS));
+    memset(t, 0, node_size(NUM_LEVELS));
+    h->k = SENTINEL_KEYMIN;
+    t->k = SENTINEL_KEYMAX;
+    h->level = t->level = NUM_LEVELS;
+    pq->head = ref(pq, h);
+    pq->tail = ref(pq, t);
+    for (i = 0; i < NUM_LEVELS; i++)
+        atomic_init(&h->next[i], pq->tail);
+
+    /* The allocators of the levels registered before a failure stay
+     * in the GC's table, and so does the arena their blocks are in. */
+    for (i = 0; i < NUM_LEVELS; i++)
+        if ((pq->gc_id[i] = gc_add_arena_allocator(node_size(i + 1),
+                                                   pq->arena)) < 0) {
+            free(pq);
+            errno = ENOSPC;
+            return NULL;
+        }
+
+    return pq;
+}
+
+void
+pqi_destroy(pqi_t *pq)
+{
+    pqi_ref_t cur, pred;
+
+    critical_enter();
+    cur = unmarked(get_next(node(pq, pq->head), 0));
+    while (cur != pq->tail) {
+        pred = cur;
+        cur = unmarked(get_next(node(pq, pred), 0));
+        free_node(pq, node(pq, pred));
+    }
+    critical_exit();
+    free(pq);
+}
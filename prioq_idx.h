@@ -0,0 +1,54 @@
+#ifndef PRIOQ_IDX_H
+#define PRIOQ_IDX_H
+
+#include "prioq.h"
+#include "gc/arena.h"
+
+/* Compact index build of the queue.
+ *
+ * The same algorithm as prioq.c, but all nodes live in one arena,
+ * and next pointers are 32-bit references: the node's offset from the
+ * arena base in 8-byte words, shifted left once, with the delete mark
+ * in bit 0. Reference 0 is never a node. Towers take half the space,
+ * so a descent reads twice as many next pointers per cache line. The
+ * arena, and thus the queue, is limited to 16 GB of nodes. */
+
+typedef uint32_t pqi_ref_t;
+
+typedef struct pqi_node_s
+{
+    pkey_t    k;
+    pval_t    v;
+    uint16_t  level;
+    _Atomic uint16_t  inserting;
+    _Atomic pqi_ref_t next[1];
+} pqi_node_t;
+
+typedef struct
+{
+    int      max_offset;
+    int      level_bits;
+    arena_t *arena;
+    int      gc_id[NUM_LEVELS];
+    pqi_ref_t head;
+    pqi_ref_t tail;
+    char     pad[128];
+} pqi_t;
+
+/* Queue with nodes in an arena of arena_size bytes (address space,
+ * backed on use). The arena is not returned by pqi_destroy(), since
+ * the collector keeps its blocks. Each queue also takes 17 of the 128
+ * allocator slots of the GC for good, which it shares with the other
+ * builds (the pointer and fat node builds take up to 32 each), so at
+ * most 7 queues can be created per process, or 4 next to a pointer
+ * and a fat node queue. Returns NULL, with errno ENOSPC, when the
+ * slots are used up. */
+extern pqi_t *pqi_init(int max_offset, size_t arena_size);
+
+extern void pqi_destroy(pqi_t *pq);
+
+extern void pqi_insert(pqi_t *pq, pkey_t k, pval_t v);
+
+extern pval_t pqi_deletemin(pqi_t *pq);
+
+#endif // PRIOQ_IDX_H
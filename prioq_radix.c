@@ -0,0 +1,479 @@
+/*************************************************************************
+ * prioq_radix.c
+ *
+ * Concurrent priority queue, radix index build.
+ *
+ * Copyright (c) 2012-2018, Jonatan Linden
+ *
+ * The bottom level list and deletemin are those of prioq.c, see there
+ * for the details and the license. The upper skiplist levels are
+ * replaced by a trie of entry points into the list, see
+ * prioq_radix.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "gc/ptst.h"
+#include "common.h"
+#include "prioq_radix.h"
+
+extern __thread ptst_t *ptst;
+
+/* Orderings as in prioq.c. */
+#define get_next(_n, _i)                                                \
+    atomic_load_explicit(&(_n)->next[_i], memory_order_acquire)
+#define get_next_rlx(_n, _i)                                            \
+    atomic_load_explicit(&(_n)->next[_i], memory_order_relaxed)
+#define set_next(_n, _i, _v)                                            \
+    atomic_store_explicit(&(_n)->next[_i], (_v), memory_order_relaxed)
+#define cas_next(_n, _i, _o, _v, _mo)                                   \
+    ({ node_t *__o = (_o);                                              \
+       atomic_compare_exchange_strong_explicit(&(_n)->next[_i], &__o,   \
+           (_v), (_mo), memory_order_relaxed); })
+#define mark_next(_n)                                                   \
+    ((node_t *) atomic_fetch_or_explicit(                               \
+        (_Atomic uintptr_t *)&(_n)->next[0], 1, memory_order_acq_rel))
+#define get_inserting(_n)                                               \
+    atomic_load_explicit(&(_n)->inserting, memory_order_acquire)
+#define clear_inserting(_n)                                             \
+    atomic_store_explicit(&(_n)->inserting, 0, memory_order_release)
+
+
+/***** trie *****
+ *
+ * slot[] of an inner trie node holds its children, slot[] of a leaf
+ * the entry point of each bucket. bits[] has a bit per non-empty
+ * slot, and sum[] a bit per non-zero word of bits[]. Inner slots are
+ * only emptied when a leaf is unlinked. Leaf slots are emptied when
+ * their node is reclaimed, and the bits of an emptied slot are cleared
+ * after the slot, and set again if the slot was refilled meanwhile, so
+ * a set bit may be stale but a non-empty slot always has its bit set,
+ * once its registration is complete.
+ */
+
+#define TRIE_SLOTS (1 << PQR_STRIDE)
+#define TRIE_WORDS (TRIE_SLOTS / 64)
+
+/* Slots probed by a predecessor search before it gives up and starts
+ * from the head. */
+#define PQR_PROBES 16
+
+struct pqr_trie_s
+{
+    _Atomic uint64_t sum[TRIE_WORDS / 64];
+    _Atomic uint64_t bits[TRIE_WORDS];
+    void *_Atomic    slot[TRIE_SLOTS];
+};
+
+typedef struct pqr_trie_s trie_t;
+
+#define get_slot(_t, _i)                                                \
+    atomic_load_explicit(&(_t)->slot[_i], memory_order_acquire)
+#define cas_slot(_t, _i, _o, _v)                                        \
+    ({ void *__o = (_o);                                                \
+       atomic_compare_exchange_strong_explicit(&(_t)->slot[_i], &__o,   \
+           (_v), memory_order_acq_rel, memory_order_relaxed); })
+
+static inline int
+trie_idx(uint64_t b, int l)
+{
+    return (b >> (PQR_STRIDE * l)) & (TRIE_SLOTS - 1);
+}
+
+static trie_t *
+trie_new(void)
+{
+    trie_t *t = mmap(NULL, sizeof *t, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t == MAP_FAILED) {
+        perror("mmap");
+        abort();
+    }
+    return t;
+}
+
+static void
+trie_destroy(trie_t *t, int l)
+{
+    if (l > 0)
+        for (int i = 0; i < TRIE_SLOTS; i++)
+            if (atomic_load_explicit(&t->slot[i], memory_order_relaxed))
+                trie_destroy(t->slot[i], l - 1);
+    munmap(t, sizeof *t);
+}
+
+/* The bit and summary updates are sequentially consistent, so that
+ * a concurrent set and clear of bits in the same word cannot leave
+ * the summary bit cleared. */
+static void
+set_bit(trie_t *t, int i)
+{
+    int w = i >> 6;
+    uint64_t sm = 1UL << (w & 63);
+
+    atomic_fetch_or(&t->bits[w], 1UL << (i & 63));
+    if (!(atomic_load(&t->sum[w >> 6]) & sm))
+        atomic_fetch_or(&t->sum[w >> 6], sm);
+}
+
+static void
+clear_bit(trie_t *t, int i)
+{
+    int w = i >> 6;
+    uint64_t m = 1UL << (i & 63), sm = 1UL << (w & 63);
+
+    if (atomic_fetch_and(&t->bits[w], ~m) & ~m)
+        return;
+    atomic_fetch_and(&t->sum[w >> 6], ~sm);
+    if (atomic_load(&t->bits[w]))
+        atomic_fetch_or(&t->sum[w >> 6], sm);
+}
+
+/* No slot of t has its bit set. */
+static int
+trie_empty(trie_t *t)
+{
+    for (int w = 0; w < TRIE_WORDS / 64; w++)
+        if (atomic_load(&t->sum[w]))
+            return 0;
+    return 1;
+}
+
+/* GC hook, unmaps a leaf once no thread can see it anymore. */
+static void
+leaf_reclaimed(ptst_t *p, void *t)
+{
+    munmap(t, sizeof(trie_t));
+}
+
+/* Take the empty leaf t out of slot i of its parent p. An entry
+ * point registered in t between the check that it is empty and the
+ * unlink is lost, which only costs a longer search. */
+static void
+trie_unlink(pqr_t *pq, trie_t *p, int i, trie_t *t)
+{
+    if (!cas_slot(p, i, t, NULL))
+        return;
+    clear_bit(p, i);
+    if (get_slot(p, i))
+        set_bit(p, i);
+    atomic_fetch_sub_explicit(&pq->leaves, 1, memory_order_relaxed);
+    gc_add_ptr_to_hook_list(ptst, t, pq->hook_id);
+}
+
+/* Highest slot at or below i with its bit set, or -1. */
+static int
+prev_set(trie_t *t, int i)
+{
+    int w, sw;
+    uint64_t m, sm;
+
+    if (i < 0) return -1;
+    w = i >> 6;
+    m = atomic_load_explicit(&t->bits[w], memory_order_relaxed)
+        & (~0UL >> (63 - (i & 63)));
+    if (m) return w * 64 + 63 - __builtin_clzl(m);
+
+    sw = w >> 6;
+    sm = atomic_load_explicit(&t->sum[sw], memory_order_relaxed)
+        & ((1UL << (w & 63)) - 1);
+    for (;;) {
+        while (sm) {
+            w = sw * 64 + 63 - __builtin_clzl(sm);
+            m = atomic_load_explicit(&t->bits[w], memory_order_relaxed);
+            if (m) return w * 64 + 63 - __builtin_clzl(m);
+            sm &= ~(1UL << (w & 63));
+        }
+        if (--sw < 0) return -1;
+        sm = atomic_load_explicit(&t->sum[sw], memory_order_relaxed);
+    }
+}
+
+/* Leaf of bucket b, created on the way if create is set. Its parent
+ * is stored in *parent, NULL if the root is the leaf. */
+static trie_t *
+trie_leaf(pqr_t *pq, uint64_t b, int create, trie_t **parent)
+{
+    trie_t *t = pq->root, *c, *n;
+    int i;
+
+    *parent = NULL;
+    for (int l = pq->depth - 1; l > 0; l--) {
+        i = trie_idx(b, l);
+        c = get_slot(t, i);
+        if (c == NULL) {
+            if (!create) return NULL;
+            n = trie_new();
+            if (cas_slot(t, i, NULL, n)) {
+                c = n;
+                if (l == 1)
+                    atomic_fetch_add_explicit(&pq->leaves, 1,
+                                              memory_order_relaxed);
+            } else {
+                munmap(n, sizeof *n);
+                c = get_slot(t, i);
+            }
+            set_bit(t, i);
+        }
+        *parent = t;
+        t = c;
+    }
+    return t;
+}
+
+/* Entry point with a key smaller than k, found in the buckets at or
+ * below b in t at level l while path is set, and at its largest
+ * bucket otherwise. */
+static node_t *
+trie_pred(trie_t *t, int l, uint64_t b, pkey_t k, int path, int *budget)
+{
+    int i = path ? trie_idx(b, l) : TRIE_SLOTS - 1;
+    node_t *x;
+    void *p;
+
+    for (int j = prev_set(t, i); j >= 0 && --*budget >= 0; j = prev_set(t, j - 1)) {
+        if ((p = get_slot(t, j)) == NULL)
+            continue;
+        if (l == 0) {
+            x = p;
+            if (x->k < k) return x;
+        } else if ((x = trie_pred(p, l - 1, b, k, path && j == i, budget))) {
+            return x;
+        }
+    }
+    return NULL;
+}
+
+/* Make n the entry point of its bucket, unless the bucket has a live
+ * one with a smaller key. Called while n is still flagged as being
+ * inserted, so that it is not reclaimed before it is registered. */
+static void
+register_node(pqr_t *pq, node_t *n)
+{
+    uint64_t b = n->k >> pq->bucket_bits;
+    trie_t *p, *t = trie_leaf(pq, b, 1, &p);
+    int i = trie_idx(b, 0);
+    node_t *cur = get_slot(t, i);
+
+    for (;;) {
+        if (cur && cur->k < n->k && !is_marked_ref(get_next_rlx(cur, 0)))
+            return;
+        if (cas_slot(t, i, cur, n))
+            break;
+        cur = get_slot(t, i);
+    }
+    if (cur == NULL)
+        set_bit(t, i);
+}
+
+/* Remove n as an entry point, before it is reclaimed, and the leaf
+ * with it if that was its last one. */
+static void
+unregister_node(pqr_t *pq, node_t *n)
+{
+    uint64_t b = n->k >> pq->bucket_bits;
+    trie_t *p, *t = trie_leaf(pq, b, 0, &p);
+    int i = trie_idx(b, 0);
+
+    if (t == NULL || !cas_slot(t, i, n, NULL))
+        return;
+    clear_bit(t, i);
+    if (get_slot(t, i))
+        set_bit(t, i);
+    else if (p && trie_empty(t))
+        trie_unlink(pq, p, trie_idx(b, 1), t);
+}
+
+
+static node_t *
+alloc_node(pqr_t *pq)
+{
+    node_t *n = gc_alloc(ptst, pq->gc_id);
+    n->level = 1;
+    atomic_init(&n->inserting, 1);
+    set_next(n, 0, NULL);
+    return n;
+}
+
+static void
+free_node(pqr_t *pq, node_t *n)
+{
+    gc_free(ptst, (void *)n, pq->gc_id);
+}
+
+
+/* The bottom level part of locate_preds() of prioq.c, started from
+ * the entry point of the closest non-empty bucket instead of the
+ * head. An entry point may be deleted, but is not reclaimed before
+ * it is unregistered, and a reclaimed node has a marked next
+ * pointer, so an insert after it fails as in prioq.c. */
+static void
+locate_preds(pqr_t * restrict pq, pkey_t k, node_t ** restrict preds,
+             node_t ** restrict succs)
+{
+    node_t *x, *x_next;
+    int d, budget = PQR_PROBES;
+
+    x = trie_pred(pq->root, pq->depth - 1, k >> pq->bucket_bits, k, 1, &budget);
+    if (x == NULL) x = pq->head;
+
+    x_next = get_next(x, 0);
+    d = is_marked_ref(x_next);
+    x_next = get_unmarked_ref(x_next);
+    while (x_next->k < k || is_marked_ref(get_next_rlx(x_next, 0)) || d) {
+        x = x_next;
+        x_next = get_next(x, 0);
+        d = is_marked_ref(x_next);
+        x_next = get_unmarked_ref(x_next);
+    }
+    preds[0] = x;
+    succs[0] = x_next;
+}
+
+
+/* See insert_node() of prioq.c. The node is registered in the trie
+ * in place of the inserts at the upper levels. */
+static int
+insert_node(pqr_t *pq, node_t *new)
+{
+    node_t *preds[1], *succs[1];
+    pkey_t k = new->k;
+
+ retry:
+    locate_preds(pq, k, preds, succs);
+
+    if (succs[0]->k == k && get_next(preds[0], 0) == succs[0]) {
+        clear_inserting(new);
+        return 0;
+    }
+    set_next(new, 0, succs[0]);
+
+    if (!cas_next(preds[0], 0, succs[0], new, memory_order_release))
+        goto retry;
+
+    register_node(pq, new);
+    clear_inserting(new);
+    return 1;
+}
+
+void
+pqr_insert(pqr_t *pq, pkey_t k, pval_t v)
+{
+    node_t *new;
+
+    assert(SENTINEL_KEYMIN < k && k < SENTINEL_KEYMAX);
+    critical_enter();
+    new    = alloc_node(pq);
+    new->k = k;
+    new->v = v;
+    if (!insert_node(pq, new))
+        free_node(pq, new);
+    critical_exit();
+}
+
+
+/* See delete_node() of prioq.c. There are no upper head pointers to
+ * restructure, and reclaimed nodes are first unregistered. */
+pval_t
+pqr_deletemin(pqr_t *pq)
+{
+    node_t *x, *nxt, *obs_head, *newhead = NULL, *cur;
+    pval_t v = NULL;
+    int offset = 0;
+
+    critical_enter();
+
+    x = pq->head;
+    obs_head = get_next(x, 0);
+
+    do {
+        offset++;
+        nxt = get_next(x, 0);
+        if (get_unmarked_ref(nxt) == pq->tail)
+            goto out;
+        if (newhead == NULL && get_inserting(x)) newhead = x;
+        if (is_marked_ref(nxt)) continue;
+        nxt = mark_next(x);
+    }
+    while ( (x = get_unmarked_ref(nxt)) && is_marked_ref(nxt) );
+
+    assert(!is_marked_ref(x));
+    v = x->v;
+    if (newhead == NULL) newhead = x;
+
+    if (offset <= pq->max_offset) goto out;
+    if (get_next_rlx(pq->head, 0) != obs_head) goto out;
+
+    if (cas_next(pq->head, 0, obs_head, get_marked_ref(newhead),
+                 memory_order_acq_rel))
+    {
+        cur = get_unmarked_ref(obs_head);
+        while (cur != get_unmarked_ref(newhead)) {
+            nxt = get_unmarked_ref(get_next_rlx(cur, 0));
+            assert(is_marked_ref(get_next_rlx(cur, 0)));
+            unregister_node(pq, cur);
+            free_node(pq, cur);
+            cur = nxt;
+        }
+    }
+ out:
+    critical_exit();
+    return v;
+}
+
+
+pqr_t *
+pqr_init(int max_offset, int bucket_bits)
+{
+    node_t *h, *t;
+    pqr_t *pq;
+
+    assert(0 <= bucket_bits && bucket_bits < 64);
+
+    E_NULL(pq = malloc(sizeof *pq));
+    if ((pq->gc_id = gc_add_allocator(sizeof(node_t))) < 0 ||
+        (pq->hook_id = gc_add_hook(leaf_reclaimed)) < 0) {
+        free(pq);
+        errno = ENOSPC;
+        return NULL;
+    }
+    E_NULL(h = calloc(1, sizeof *h));
+    E_NULL(t = calloc(1, sizeof *t));
+    h->k = SENTINEL_KEYMIN;
+    t->k = SENTINEL_KEYMAX;
+    h->level = t->level = 1;
+    atomic_init(&h->next[0], t);
+
+    pq->head = h;
+    pq->tail = t;
+    pq->max_offset = max_offset;
+    pq->bucket_bits = bucket_bits;
+    pq->depth = (64 - bucket_bits + PQR_STRIDE - 1) / PQR_STRIDE;
+    pq->root = trie_new();
+    atomic_init(&pq->leaves, pq->depth == 1);
+
+    return pq;
+}
+
+void
+pqr_destroy(pqr_t *pq)
+{
+    node_t *cur, *pred;
+
+    critical_enter();
+    cur = get_unmarked_ref(get_next(pq->head, 0));
+    while (cur != pq->tail) {
+        pred = cur;
+        cur = get_unmarked_ref(get_next(pred, 0));
+        free_node(pq, pred);
+    }
+    critical_exit();
+    trie_destroy(pq->root, pq->depth - 1);
+    free(pq->tail);
+    free(pq->head);
+    free(pq);
+}
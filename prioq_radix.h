@@ -0,0 +1,59 @@
+#ifndef PRIOQ_RADIX_H
+#define PRIOQ_RADIX_H
+
+#include "prioq.h"
+
+/* Radix index build of the queue.
+ *
+ * The bottom level list and deletemin are those of prioq.c, but
+ * there are no upper levels. Instead, the predecessor search starts
+ * from an entry point found in a lock-free trie over the key bits.
+ *
+ * Keys are grouped in buckets of 2^bucket_bits consecutive keys. The
+ * trie has 16-bit strides, so at most 4 levels, and its leaves hold,
+ * for each bucket, one node of the bucket, preferably the one with the
+ * smallest key. A bitmap per trie node finds the closest non-empty
+ * bucket below a key. Trie nodes are reserved with mmap, so only the
+ * touched pages cost memory. A leaf is unlinked when its last entry
+ * point is reclaimed, and unmapped by the GC once no thread can see
+ * it, so with keys that keep growing, as in discrete event
+ * simulation, the leaves follow the live keys. Inner nodes, each
+ * covering 2^32 buckets or more, are kept until pqr_destroy().
+ *
+ * Two limits follow from this layout. Each trie node is a separate
+ * mmap of about 520KB, made on the insert path when a key falls under
+ * a node that does not exist yet, so keys spread over the 64-bit range
+ * cost a system call and a few fresh pages each, where keys within a
+ * few 2^32 buckets share their nodes. And a predecessor search gives
+ * up after PQR_PROBES trie slots and walks the bottom list from the
+ * head, which is O(n); that happens when the bits set below a key
+ * lead to slots that are already cleared or hold larger keys, as while
+ * deletemins reclaim entry points faster than their bits are cleared. */
+
+#define PQR_STRIDE 16
+
+typedef struct
+{
+    int                 max_offset;
+    int                 bucket_bits;
+    int                 depth;
+    int                 gc_id;
+    int                 hook_id;
+    _Atomic long        leaves;  /* mapped trie leaves */
+    node_t             *head;
+    node_t             *tail;
+    struct pqr_trie_s  *root;
+    char                pad[128];
+} pqr_t;
+
+/* Returns NULL, with errno ENOSPC, if the GC's table of allocators or
+ * of hooks is full. */
+extern pqr_t *pqr_init(int max_offset, int bucket_bits);
+
+extern void pqr_destroy(pqr_t *pq);
+
+extern void pqr_insert(pqr_t *pq, pkey_t k, pval_t v);
+
+extern pval_t pqr_deletemin(pqr_t *pq);
+
+#endif // PRIOQ_RADIX_H
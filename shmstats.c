@@ -0,0 +1,118 @@
+/**
+ * Statistics export to shared memory.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "gc/ptst.h"
+#include "shmstats.h"
+
+static pq_shm_t *shm;
+static char *shm_name;
+static pthread_t publisher;
+static volatile int publishing;
+
+
+static void
+shm_update(void)
+{
+    struct timespec now;
+    unsigned long in = 0, out = 0;
+    unsigned int n = 0;
+    ptst_t *p;
+
+    shm->seq++;
+    IWMB();
+
+    gettime(&now);
+    shm->time_ns = now.tv_sec * 1000000000UL + now.tv_nsec;
+    shm->epoch = gc_current_epoch();
+
+    shm->npools = min(gc_nr_allocators(), SHM_MAX_POOLS);
+    for (int i = 0; i < shm->npools; i++)
+        gc_allocator_info(i, &shm->pools[i].blk_size,
+                          &shm->pools[i].heap_size);
+
+    for (p = ptst_first(); p != NULL && n < SHM_MAX_THREADS; p = ptst_next(p)) {
+#ifdef PQ_STATS
+        pq_stats_t *s = &shm->threads[n];
+        for (size_t i = 0; i < STAT_WORDS; i++)
+            ((unsigned long *)s)[i] =
+                atomic_load_explicit(&p->counters[i], memory_order_relaxed);
+        in  += s->inserts - s->duplicates;
+        out += s->deletemins - s->empty;
+#endif
+        n++;
+    }
+    shm->nthreads = n;
+    shm->length = in > out ? in - out : 0;
+
+    IWMB();
+    shm->seq++;
+}
+
+
+static void *
+publish(void *_arg)
+{
+    struct timespec now;
+
+    while (publishing) {
+        /* nothing to do unless somebody is watching */
+        gettime(&now);
+        if (now.tv_sec * 1000000000UL + now.tv_nsec < shm->lease_ns)
+            shm_update();
+        usleep(SHM_PERIOD_US);
+    }
+    return NULL;
+}
+
+
+int
+pq_shm_publish(const char *name)
+{
+    int fd;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror("pq_shm_publish");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof *shm) < 0) {
+        perror("pq_shm_publish");
+        close(fd);
+        return -1;
+    }
+    shm = mmap(NULL, sizeof *shm, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("pq_shm_publish");
+        shm_unlink(name);
+        return -1;
+    }
+
+    shm->version = SHM_VERSION;
+    IWMB();
+    shm->magic = SHM_MAGIC;
+    shm_name = strdup(name);
+
+    publishing = 1;
+    E_en(pthread_create(&publisher, NULL, publish, NULL));
+    return 0;
+}
+
+
+void
+pq_shm_unpublish(void)
+{
+    publishing = 0;
+    pthread_join(publisher, NULL);
+    munmap(shm, sizeof *shm);
+    shm_unlink(shm_name);
+    free(shm_name);
+}
@@ -0,0 +1,71 @@
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include "common.h"
+#include "stats.h"
+
+/* Statistics export to a POSIX shared memory object, for pq_top.
+ *
+ * A publisher thread copies the per-thread counters (see stats.h),
+ * the GC pool sizes and the current epoch into the region, but only
+ * while a reader holds the lease: readers push lease_ns forward, a
+ * CLOCK_MONOTONIC time, at every read, so a reader that dies stops
+ * the publishing once its lease runs out. Readers retry their copy
+ * while seq is odd or has changed (seqlock). */
+
+#define SHM_MAGIC       0x504d4853 /* "SHMP" */
+#define SHM_VERSION     2
+#define SHM_MAX_THREADS 128
+#define SHM_MAX_POOLS   32
+#define SHM_PERIOD_US   100000
+#define SHM_LEASE_US    1000000 /* slack beyond a reader's next read */
+
+typedef struct
+{
+    unsigned int  blk_size;
+    unsigned long heap_size;
+} shm_pool_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    /* odd while the publisher is writing */
+    volatile uint32_t seq;
+    uint32_t   pad;
+    /* publish until then, see pq_shm_renew() */
+    volatile uint64_t lease_ns;
+
+    uint64_t   time_ns;
+    uint32_t   epoch;
+    uint32_t   nthreads;
+    /* approximate number of elements of all queues of the process,
+     * from the counters, so 0 unless built with PQ_STATS */
+    uint64_t   length;
+    uint32_t   npools;
+    shm_pool_t pools[SHM_MAX_POOLS];
+    pq_stats_t threads[SHM_MAX_THREADS];
+} pq_shm_t;
+
+/* Create the object NAME (e.g., "/pq") and start publishing. */
+extern int pq_shm_publish(const char *name);
+
+/* Stop publishing and remove the object. */
+extern void pq_shm_unpublish(void);
+
+/* Reader side, keep the publisher going for usecs more, plus
+ * SHM_LEASE_US. Never shortens the lease of another reader. */
+static inline void
+pq_shm_renew(pq_shm_t *shm, unsigned long usecs)
+{
+    struct timespec now;
+    uint64_t until, old;
+
+    gettime(&now);
+    until = now.tv_sec * 1000000000UL + now.tv_nsec +
+        (usecs + SHM_LEASE_US) * 1000UL;
+    while ((old = shm->lease_ns) < until &&
+           !__sync_bool_compare_and_swap(&shm->lease_ns, old, until)) ;
+}
+
+#endif // SHMSTATS_H
@@ -0,0 +1,45 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+/* Per-thread operation counters of the queue, kept in the counters of
+ * the thread state when built with PQ_STATS (make STATS=true), a word
+ * per field of pq_stats_t. Each thread only writes its own counters,
+ * with a relaxed load and store, and other threads read them with
+ * relaxed loads. */
+
+#define STATS_OFFSET_BUCKETS 16
+
+typedef struct
+{
+    unsigned long inserts;
+    unsigned long insert_retries;       /* failed bottom level CAS */
+    unsigned long insert_retries_upper; /* failed upper level CAS */
+    unsigned long duplicates;
+    unsigned long deletemins;
+    unsigned long empty;
+    /* deletemin traversal offset, bucket i holds [2^i, 2^(i+1)) */
+    unsigned long offset_hist[STATS_OFFSET_BUCKETS];
+    unsigned long swing_attempts;
+    unsigned long swing_wins;
+    unsigned long restructure_iters;
+    unsigned long nodes_freed;
+} pq_stats_t;
+
+#define STAT_WORDS (sizeof(pq_stats_t) / sizeof(unsigned long))
+
+#ifdef PQ_STATS
+#define STAT_INC(_f)    STAT_ADD(_f, 1)
+#define STAT_ADD(_f,_n)                                                 \
+    ({ _Atomic unsigned long *__c = &ptst->counters[                    \
+           offsetof(pq_stats_t, _f) / sizeof(unsigned long)];           \
+       atomic_store_explicit(__c, (_n) +                                \
+           atomic_load_explicit(__c, memory_order_relaxed),             \
+           memory_order_relaxed); })
+#else
+#define STAT_INC(_f)    ((void)0)
+#define STAT_ADD(_f,_n) ((void)0)
+#endif
+
+#endif // STATS_H
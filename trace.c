@@ -0,0 +1,212 @@
+/**
+ * Operation trace recording and loading.
+ *
+ * Each thread appends records to its own buffer. A full buffer is
+ * written out with a single pwrite, at a file offset reserved with
+ * fetch-and-add, so recording threads never synchronize otherwise.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define TRACE_BUF_LEN 4096
+
+typedef struct trace_buf_s
+{
+    struct trace_buf_s *next;
+    uint16_t     thread;
+    int          n;
+    trace_rec_t  recs[TRACE_BUF_LEN];
+} trace_buf_t;
+
+static int fd = -1;
+static volatile int tracing = 0;
+static int trace_phase;
+static struct timespec trace_start;
+static off_t trace_off;
+
+static trace_buf_t *buf_list = NULL;
+static uint16_t next_thread = 0;
+static __thread trace_buf_t *tbuf;
+
+
+static trace_buf_t *
+trace_buf_new(void)
+{
+    trace_buf_t *b, *next;
+
+    E_NULL(b = calloc(1, sizeof *b));
+    b->thread = __sync_fetch_and_add(&next_thread, 1);
+    do {
+        next = buf_list;
+        b->next = next;
+    } while (!__sync_bool_compare_and_swap(&buf_list, next, b));
+    return b;
+}
+
+
+static void
+trace_flush(trace_buf_t *b)
+{
+    size_t sz = b->n * sizeof(trace_rec_t);
+    off_t off = __sync_fetch_and_add(&trace_off, sz);
+
+    if (pwrite(fd, b->recs, sz, off) != (ssize_t) sz)
+        perror("trace_flush");
+    b->n = 0;
+}
+
+
+int
+trace_open(const char *path)
+{
+    trace_hdr_t hdr = { TRACE_MAGIC, TRACE_VERSION };
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("trace_open");
+        return -1;
+    }
+    E(write(fd, &hdr, sizeof hdr));
+    trace_off = sizeof hdr;
+    trace_phase = TRACE_PREFILL;
+    gettime(&trace_start);
+    IWMB();
+    tracing = 1;
+    return 0;
+}
+
+
+void
+trace_run(void)
+{
+    trace_phase = TRACE_RUN;
+    gettime(&trace_start);
+    IWMB();
+}
+
+
+void
+trace_record(int op, uint64_t k)
+{
+    trace_buf_t *b = tbuf;
+    trace_rec_t *r;
+    struct timespec now;
+
+    if (!tracing) return;
+    if (b == NULL)
+        tbuf = b = trace_buf_new();
+
+    gettime(&now);
+    now = timediff(trace_start, now);
+
+    r = &b->recs[b->n++];
+    r->k = k;
+    r->t = now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+    r->thread = b->thread;
+    r->op = op;
+    r->phase = trace_phase;
+    r->pad = 0;
+
+    if (b->n == TRACE_BUF_LEN)
+        trace_flush(b);
+}
+
+
+/* Must only be called when no thread is recording. */
+void
+trace_close(void)
+{
+    tracing = 0;
+    IMB();
+    for (trace_buf_t *b = buf_list; b; b = b->next)
+        if (b->n) trace_flush(b);
+    E(close(fd));
+    fd = -1;
+}
+
+
+int
+trace_load(const char *path, trace_stream_t *prefill,
+           trace_stream_t **streams, int *nstreams)
+{
+    trace_hdr_t hdr;
+    trace_rec_t *recs;
+    trace_stream_t *s;
+    struct stat st;
+    size_t n, i, np = 0;
+    int ifd, nt = 0, *idx;
+
+    if ((ifd = open(path, O_RDONLY)) < 0 || fstat(ifd, &st) < 0) {
+        perror("trace_load");
+        return -1;
+    }
+    if (read(ifd, &hdr, sizeof hdr) != sizeof hdr ||
+        hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+        fprintf(stderr, "trace_load: %s: not a trace file\n", path);
+        close(ifd);
+        return -1;
+    }
+
+    n = (st.st_size - sizeof hdr) / sizeof(trace_rec_t);
+    E_NULL(recs = malloc(n * sizeof *recs));
+    if (read(ifd, recs, n * sizeof *recs) != (ssize_t)(n * sizeof *recs)) {
+        perror("trace_load");
+        free(recs);
+        close(ifd);
+        return -1;
+    }
+    close(ifd);
+
+    /* the prefill phase goes first, as one stream */
+    E_NULL(prefill->recs = malloc(n * sizeof *recs));
+    for (i = 0; i < n; i++)
+        if (recs[i].phase == TRACE_PREFILL)
+            prefill->recs[np++] = recs[i];
+    prefill->len = np;
+
+    /* a stream per thread of the run phase, numbered in thread order */
+    E_NULL(idx = calloc(UINT16_MAX + 1, sizeof *idx));
+    for (i = 0; i < n; i++)
+        if (recs[i].phase == TRACE_RUN)
+            idx[recs[i].thread] = 1;
+    for (int j = 0; j <= UINT16_MAX; j++)
+        idx[j] = idx[j] ? nt++ : -1;
+
+    E_NULL(s = calloc(nt, sizeof *s));
+    for (i = 0; i < n; i++)
+        if (recs[i].phase == TRACE_RUN)
+            s[idx[recs[i].thread]].len++;
+    for (int j = 0; j < nt; j++) {
+        E_NULL(s[j].recs = malloc(s[j].len * sizeof(trace_rec_t)));
+        s[j].len = 0;
+    }
+    for (i = 0; i < n; i++)
+        if (recs[i].phase == TRACE_RUN) {
+            trace_stream_t *x = &s[idx[recs[i].thread]];
+            x->recs[x->len++] = recs[i];
+        }
+
+    free(idx);
+    free(recs);
+    *streams = s;
+    *nstreams = nt;
+    return 0;
+}
+
+
+void
+trace_free(trace_stream_t *prefill, trace_stream_t *streams, int nstreams)
+{
+    free(prefill->recs);
+    for (int i = 0; i < nstreams; i++)
+        free(streams[i].recs);
+    free(streams);
+}
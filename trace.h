@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+/* Operation trace format. A file is a trace_hdr_t followed by
+ * trace_rec_t records. Records of one thread appear in the file in
+ * the order they were performed, records of different threads are
+ * interleaved in blocks. A trace starts in the prefill phase, whose
+ * records are all done before any of the run phase, see trace_run(). */
+
+#define TRACE_MAGIC   0x52545150 /* "PQTR" */
+#define TRACE_VERSION 2
+
+#define TRACE_INSERT    1
+#define TRACE_DELETEMIN 2
+
+#define TRACE_PREFILL   0
+#define TRACE_RUN       1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+} trace_hdr_t;
+
+typedef struct
+{
+    uint64_t k;      /* key inserted or deleted, 0 if queue was empty */
+    uint64_t t;      /* usecs since the start of the phase */
+    uint16_t thread;
+    uint8_t  op;
+    uint8_t  phase;
+    uint32_t pad;
+} trace_rec_t;
+
+
+/* Recording. Records are buffered per thread and written out in
+ * blocks, trace_close() flushes the buffers of all threads. */
+
+extern int trace_open(const char *path);
+
+/* End the prefill phase, and start the clock of the run phase. Must
+ * only be called when no thread is recording. */
+extern void trace_run(void);
+
+extern void trace_record(int op, uint64_t k);
+
+extern void trace_close(void);
+
+
+/* Replay. Loads a trace into one stream of its prefill phase, in file
+ * order, which is the order of recording if one thread prefilled, and
+ * one stream per thread that recorded in its run phase. */
+
+typedef struct
+{
+    trace_rec_t *recs;
+    size_t       len;
+} trace_stream_t;
+
+extern int trace_load(const char *path, trace_stream_t *prefill,
+                      trace_stream_t **streams, int *nstreams);
+
+extern void trace_free(trace_stream_t *prefill, trace_stream_t *streams,
+                       int nstreams);
+
+#endif // TRACE_H
@@ -2,21 +2,51 @@
 #include <assert.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "gc/gc.h"
 
 #include "prioq.h"
+#include "prioq_idx.h"
+#include "prioq_fat.h"
+#include "prioq_radix.h"
+#include "executor.h"
 #include "common.h"
 
 #define PER_THREAD 30
 
 static pq_t *pq;
+static pqi_t *ipq;
+static pqf_t *fpq;
+static pqr_t *rpq;
+static pq_t *bpq;
+static pq_t *cpq;
+static pq_t *mpq;
+static pq_t *epq;
+static pq_t *rlx;
+static pq_t *bufq;
 
 int nthreads;
 
 pthread_t *ts;
 
 void *add_thread(void *id);
+void *index_add_thread(void *id);
+void *fat_add_thread(void *id);
+void *fat_mixed_thread(void *id);
+void *radix_add_thread(void *id);
+void *radix_mixed_thread(void *id);
+void *bounded_add_thread(void *id);
+void *clear_mixed_thread(void *id);
+void *meld_add_thread(void *id);
+void *submit_thread(void *id);
+void *eventfd_add_thread(void *id);
+void *relaxed_thread(void *id);
+void *relaxed_wait_thread(void *q);
+void *buffered_thread(void *id);
+void *buffered_flush_thread(void *id);
 void *removemin_thread(void *id);
 void *invariant_thread(void *id);
 
@@ -25,12 +55,40 @@ void *invariant_thread(void *id);
 void test_parallel_add(void);
 void test_parallel_del(void);
 void test_invariants(void);
+void test_shape(void);
+void test_intrusive(void);
+void test_index(void);
+void test_session(void);
+void test_fat(void);
+void test_radix(void);
+void test_bounded(void);
+void test_clear(void);
+void test_meld(void);
+void test_split(void);
+void test_executor(void);
+void test_eventfd(void);
+void test_relaxed(void);
+void test_buffered(void);
 
 typedef void (* test_func_t)(void);
 
 test_func_t tests[] = {
     test_parallel_del,
     test_parallel_add,
+    test_shape,
+    test_intrusive,
+    test_index,
+    test_session,
+    test_fat,
+    test_radix,
+    test_bounded,
+    test_clear,
+    test_meld,
+    test_split,
+    test_executor,
+    test_eventfd,
+    test_relaxed,
+    test_buffered,
 //    test_invariants,
     NULL
 };
@@ -74,6 +132,753 @@ test_parallel_del()
     printf("OK.\n");
 }
 
+void
+test_shape()
+{
+    pq_shape_t s;
+    unsigned long sum = 0;
+
+    printf("test shape report\n");
+
+    for (long i = 0; i < nthreads * PER_THREAD; i++)
+	insert(pq, i+1, (pval_t)i+1);
+    for (long i = 0; i < PER_THREAD; i++)
+	deletemin(pq);
+
+    pq_shape_report(pq, &s);
+    assert(s.live == (nthreads - 1) * PER_THREAD);
+    assert(s.inserting == 0);
+    for (int i = 0; i < NUM_LEVELS; i++)
+	sum += s.level_hist[i];
+    assert(sum == s.live);
+    /* nothing live may precede the bottom level head */
+    assert(s.lag[0] == s.prefix[0]);
+    assert(s.npools > 0);
+
+    printf("OK.\n");
+}
+
+void
+test_index()
+{
+    unsigned long new, old = 0;
+
+    printf("test index build, %d threads\n", nthreads);
+    ipq = pqi_init(10, 1UL << 30);
+
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, index_add_thread, (void *)i);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+
+    /* duplicate, rejected */
+    pqi_insert(ipq, 1, (pval_t) 2);
+    for (long i = 0; i < nthreads * PER_THREAD; i++) {
+	new = (long)pqi_deletemin(ipq);
+	assert (old < new);
+	old = new;
+    }
+    assert(old == nthreads * PER_THREAD);
+    assert(pqi_deletemin(ipq) == NULL);
+
+    pqi_destroy(ipq);
+    printf("OK.\n");
+}
+
+void
+test_session()
+{
+    unsigned long new, old = 0;
+    unsigned int epoch = gc_current_epoch();
+    int moved = 0;
+
+    printf("test session\n");
+
+    pq_session_begin();
+    for (long i = 0; i < nthreads * PER_THREAD; i++)
+	insert(pq, i+1, (pval_t)i+1);
+    for (long i = 0; i < nthreads * PER_THREAD; i++) {
+	new = (long)deletemin(pq);
+	assert (old < new);
+	old = new;
+    }
+    /* a long session must not hold back reclamation */
+    for (long i = 0; i < 1000 * PQ_SESSION_OPS && !moved; i++) {
+	insert(pq, 1, (pval_t) 1);
+	assert(deletemin(pq) == (pval_t) 1);
+	moved = gc_current_epoch() != epoch;
+    }
+    pq_session_end();
+    assert(moved);
+
+    printf("OK.\n");
+}
+
+void
+test_fat()
+{
+    unsigned long new, old = 0;
+
+    printf("test fat nodes, %d threads\n", nthreads);
+    fpq = pqf_init(10);
+
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, fat_add_thread, (void *)i);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+
+    /* duplicate, rejected */
+    pqf_insert(fpq, 1, (pval_t) 2);
+    for (long i = 0; i < nthreads * PER_THREAD; i++) {
+	new = (long)pqf_deletemin(fpq);
+	assert (old + 1 == new);
+	old = new;
+    }
+    assert(pqf_deletemin(fpq) == NULL);
+
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, fat_mixed_thread, (void *)i);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+    assert(pqf_deletemin(fpq) == NULL);
+
+    pqf_destroy(fpq);
+    printf("OK.\n");
+}
+
+/* Keys RADIX_STRIDE apart, in buckets of two keys, so that they are
+ * spread over several trie leaves. */
+#define RADIX_STRIDE (1UL << 17)
+
+void
+test_radix()
+{
+    unsigned long new, old = 0;
+
+    printf("test radix index, %d threads\n", nthreads);
+    rpq = pqr_init(10, 1);
+
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, radix_add_thread, (void *)i);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+
+    /* duplicate, rejected */
+    pqr_insert(rpq, RADIX_STRIDE, (pval_t) 2);
+    for (long i = 0; i < nthreads * PER_THREAD; i++) {
+	new = (long)pqr_deletemin(rpq);
+	assert (old + RADIX_STRIDE == new);
+	old = new;
+    }
+    assert(pqr_deletemin(rpq) == NULL);
+
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, radix_mixed_thread, (void *)i);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+    assert(pqr_deletemin(rpq) == NULL);
+    pqr_destroy(rpq);
+
+    /* growing keys, a leaf each, are unlinked as they are deleted */
+    rpq = pqr_init(10, 0);
+    for (unsigned long i = 1; i <= 1000; i++) {
+        pqr_insert(rpq, i << PQR_STRIDE, (pval_t) i);
+        if (i > 5)
+            assert((unsigned long) pqr_deletemin(rpq) == i - 5);
+    }
+    assert(atomic_load(&rpq->leaves) < 50);
+    pqr_destroy(rpq);
+    printf("OK.\n");
+}
+
+#define BOUND 50
+
+/* The BOUND smallest keys come out first, and at most the trim limit
+ * of the queue is kept. */
+void
+test_bounded()
+{
+    unsigned long v;
+    long n;
+
+    printf("test bounded queue, %d threads\n", nthreads);
+    bpq = pq_init_bounded(10, BOUND);
+
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, bounded_add_thread, (void *)i);
+    /* shape reports are safe while trims run */
+    for (int r = 0; r < 100; r++) {
+	pq_shape_t sh;
+	unsigned long live = 0;
+	pq_shape_report(bpq, &sh);
+	for (int i = 0; i < NUM_LEVELS; i++)
+	    live += sh.level_hist[i];
+	assert(live == sh.live);
+    }
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+
+    for (n = 0; (v = (unsigned long)deletemin(bpq)) != 0; n++)
+	assert(n >= BOUND || v == (unsigned long)n + 1);
+    assert(BOUND <= n && n <= BOUND + BOUND / 8 + 1 + nthreads);
+
+    /* drained, so smaller keys are accepted again */
+    insert(bpq, 1, (pval_t) 1);
+    assert((unsigned long)deletemin(bpq) == 1);
+
+    pq_destroy(bpq);
+    printf("OK.\n");
+}
+
+void
+test_clear()
+{
+    unsigned long new, old = 0;
+
+    printf("test clear, %d threads\n", nthreads);
+    cpq = pq_init(10);
+
+    for (long i = 0; i < 1000; i++)
+	insert(cpq, i + 1, (pval_t) i + 1);
+    pq_clear(cpq);
+    assert(deletemin(cpq) == NULL);
+
+    /* clear under concurrent operations */
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, clear_mixed_thread, (void *)i);
+    for (int i = 0; i < 100; i++) {
+	pq_clear(cpq);
+	usleep(10);
+    }
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+
+    pq_clear(cpq);
+    assert(deletemin(cpq) == NULL);
+    for (long i = PER_THREAD; i > 0; i--)
+	insert(cpq, i, (pval_t) i);
+    for (long i = 0; i < PER_THREAD; i++) {
+	new = (long)deletemin(cpq);
+	assert (old + 1 == new);
+	old = new;
+    }
+    assert(deletemin(cpq) == NULL);
+
+    pq_destroy(cpq);
+    printf("OK.\n");
+}
+
+#define MELD_N 100000
+
+/* times each key was taken from dst */
+static _Atomic char *meld_seen;
+static long meld_keys;
+static _Atomic int meld_done;
+
+void
+test_meld()
+{
+    pq_t *src;
+    unsigned long new, old = 0;
+    long n = 0;
+
+    printf("test meld, %d threads\n", nthreads);
+    mpq = pq_init(10);
+    src = pq_init(10);
+
+    /* even keys in src, behind a deleted prefix, and a few of them
+     * also in dst */
+    for (long i = 1; i <= 100; i++)
+	insert(src, i, (pval_t) 1);
+    for (long i = 51; i < MELD_N + 51; i++)
+	insert(src, 2 * i, (pval_t) (2 * i));
+    for (long i = 1; i <= 100; i++)
+	assert(deletemin(src) == (pval_t) 1);
+    for (long i = 51; i < MELD_N + 51; i += 100)
+	insert(mpq, 2 * i, (pval_t) (2 * i));
+
+    /* odd keys go into dst during the meld, and elements are taken
+     * from it */
+    meld_keys = 2 * (MELD_N + 51 + 10 * PER_THREAD * nthreads);
+    meld_seen = calloc(meld_keys, 1);
+    atomic_store(&meld_done, 0);
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, meld_add_thread, (void *)i);
+    pq_meld(mpq, src);
+    atomic_store(&meld_done, 1);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+
+    assert(deletemin(src) == NULL);
+    insert(src, 1, (pval_t) 1);
+    assert(deletemin(src) == (pval_t) 1);
+    pq_destroy(src);
+
+    while ((new = (unsigned long)deletemin(mpq)) != 0) {
+	assert(new > old);
+	old = new;
+	meld_seen[new]++;
+    }
+    /* a key both in src and dst is taken twice if the dst one was
+     * taken before the meld came to it */
+    for (long k = 0; k < meld_keys; k++) {
+	assert(meld_seen[k] <= 1 || (k % 200 == 102 && meld_seen[k] == 2));
+	n += meld_seen[k] > 0;
+    }
+    assert(n == MELD_N + (nthreads + 1) / 2 * 10 * PER_THREAD);
+    free((void *)meld_seen);
+
+    pq_destroy(mpq);
+    printf("OK.\n");
+}
+
+#define SPLIT_N 1000
+
+void
+test_split()
+{
+    pq_t *lo, *hi, *empty;
+    pq_shape_t sh;
+    unsigned long v;
+
+    printf("test split\n");
+    lo = pq_init(10);
+    for (long i = SPLIT_N; i > 0; i--)
+	insert(lo, i, (pval_t) i);
+    for (long i = 1; i <= 10; i++)
+	assert((unsigned long)deletemin(lo) == i);
+
+    hi = pq_split(lo, SPLIT_N / 2);
+    empty = pq_split(hi, SPLIT_N + 1);
+    assert(deletemin(empty) == NULL);
+    pq_destroy(empty);
+
+    /* both halves are queues of their own */
+    insert(lo, SPLIT_N, (pval_t) SPLIT_N);
+    insert(hi, 1, (pval_t) 1);
+    assert((unsigned long)deletemin(hi) == 1);
+    for (v = 11; v < SPLIT_N / 2; v++)
+	assert((unsigned long)deletemin(lo) == v);
+    assert((unsigned long)deletemin(lo) == SPLIT_N);
+    assert(deletemin(lo) == NULL);
+    for (v = SPLIT_N / 2; v <= SPLIT_N; v++)
+	assert((unsigned long)deletemin(hi) == v);
+    assert(deletemin(hi) == NULL);
+
+    pq_destroy(lo);
+    pq_destroy(hi);
+
+    /* Deleted keys at or above k stay in the deleted prefix of lo,
+     * also at the upper levels, for prefixes ending in nodes of
+     * random levels. */
+    for (long j = 1; j < 10; j++) {
+	lo = pq_init(10);
+	for (long i = 2 * SPLIT_N; i > SPLIT_N; i--)
+	    insert(lo, i, (pval_t) i);
+	for (long i = SPLIT_N + 1; i <= SPLIT_N + j; i++)
+	    assert((unsigned long)deletemin(lo) == i);
+	for (long i = 1; i <= 50; i++)
+	    insert(lo, i, (pval_t) i);
+	hi = pq_split(lo, SPLIT_N / 2);
+	for (int i = 0; i < NUM_LEVELS; i++) {
+	    node_t *x = get_unmarked_ref(atomic_load(&hi->head->next[i]));
+	    assert(x == hi->tail || x->k > (unsigned long)(SPLIT_N + j));
+	}
+	pq_shape_report(hi, &sh);
+	assert(sh.live == SPLIT_N - j);
+	for (v = 1; v <= 50; v++)
+	    assert((unsigned long)deletemin(lo) == v);
+	assert(deletemin(lo) == NULL);
+	pq_destroy(lo);
+	for (v = SPLIT_N + j + 1; v <= 2 * SPLIT_N; v++)
+	    assert((unsigned long)deletemin(hi) == v);
+	assert(deletemin(hi) == NULL);
+	pq_destroy(hi);
+    }
+    printf("OK.\n");
+}
+
+#define EXEC_TASKS 1000
+
+static exec_t *ex;
+static _Atomic long ran, started, released;
+static long order[2 * EXEC_TASKS];
+
+static void
+block_task(void *arg)
+{
+    atomic_store(&started, 1);
+    while (!atomic_load(&released))
+	usleep(100);
+}
+
+static void
+order_task(void *arg)
+{
+    order[atomic_fetch_add(&ran, 1)] = (long)arg;
+}
+
+static void
+count_task(void *arg)
+{
+    atomic_fetch_add(&ran, 1);
+    /* tasks may submit tasks */
+    if (arg)
+	assert(exec_submit(ex, 1, count_task, NULL) == 0);
+}
+
+void
+test_executor()
+{
+    exec_stats_t s;
+    long n;
+
+    printf("test executor, %d threads\n", nthreads);
+
+    /* order, with ties in submission order */
+    ex = exec_init(1, 0);
+    exec_submit(ex, 0, block_task, NULL);
+    while (!atomic_load(&started))
+	usleep(100);
+    for (long i = 2 * EXEC_TASKS - 1; i >= 0; i--)
+	assert(exec_submit(ex, i / 2, order_task, (void *)i) == 0);
+    atomic_store(&released, 1);
+    exec_shutdown(ex);
+    assert(ran == 2 * EXEC_TASKS);
+    for (long i = 0; i < 2 * EXEC_TASKS; i++)
+	assert(order[i] == (i ^ 1));
+
+    /* many submitters, many workers */
+    ran = 0;
+    ex = exec_init(nthreads, 1);
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, submit_thread, (void *)i);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+    do {
+	usleep(1000);
+	n = 0;
+	for (int i = 0; i < nthreads; i++) {
+	    exec_stats(ex, i, &s);
+	    n += s.tasks;
+	}
+    } while (n < 2 * nthreads * EXEC_TASKS);
+    assert(n == 2 * nthreads * EXEC_TASKS);
+    exec_shutdown(ex);
+    assert(ran == 2 * nthreads * EXEC_TASKS);
+
+    printf("OK.\n");
+}
+
+static int
+readable(int fd, int timeout)
+{
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    return poll(&p, 1, timeout) == 1;
+}
+
+void
+test_eventfd()
+{
+    unsigned long v, sum = 0, n = 0, total;
+    eventfd_t cnt;
+    pq_t *hpq;
+    int fd;
+
+    printf("test eventfd, %d threads\n", nthreads);
+    epq = pq_init(10);
+    fd = pq_eventfd(epq);
+    assert(fd >= 0);
+    assert(!readable(fd, 0));
+    assert(pq_eventfd_deletemin(epq) == NULL);
+
+    /* one write for many inserts */
+    for (long i = 1; i <= 100; i++)
+	insert(epq, i, (pval_t) i);
+    assert(eventfd_read(fd, &cnt) == 0 && cnt == 1);
+    for (long i = 1; i <= 100; i++)
+	assert((long)pq_eventfd_deletemin(epq) == i);
+    assert(pq_eventfd_deletemin(epq) == NULL);
+    assert(!readable(fd, 0));
+    insert(epq, 1, (pval_t) 1);
+    assert(readable(fd, 0));
+    assert(pq_eventfd_deletemin(epq) == (pval_t) 1);
+    assert(pq_eventfd_deletemin(epq) == NULL);
+
+    /* a consumer that only deletes when woken misses nothing */
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, eventfd_add_thread, (void *)i);
+    total = nthreads * 10 * PER_THREAD;
+    while (n < total) {
+	assert(readable(fd, 5000));
+	while ((v = (unsigned long)pq_eventfd_deletemin(epq)) != 0) {
+	    sum += v;
+	    n++;
+	}
+    }
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+    assert(n == total && sum == total * (total + 1) / 2);
+
+    /* a split off queue gets a readable eventfd of its own */
+    for (long i = 1; i <= 10; i++)
+	insert(epq, i, (pval_t) i);
+    hpq = pq_split(epq, 6);
+    assert(hpq->efd >= 0 && hpq->efd != fd);
+    assert(readable(hpq->efd, 0));
+    assert(pq_eventfd_deletemin(hpq) == (pval_t) 6);
+    pq_destroy(hpq);
+
+    /* a rejected insert into a bounded queue does not wake */
+    hpq = pq_init_bounded(10, 2);
+    assert(pq_eventfd(hpq) >= 0);
+    for (long i = 1; i <= 10; i++)
+	insert(hpq, i, (pval_t) i);
+    while (pq_eventfd_deletemin(hpq) != NULL) ;
+    assert(!readable(hpq->efd, 0));
+    insert(hpq, 10, (pval_t) 10);
+    assert(!readable(hpq->efd, 0));
+    insert(hpq, 1, (pval_t) 1);
+    assert(readable(hpq->efd, 0));
+    pq_destroy(hpq);
+
+    pq_destroy(epq);
+    printf("OK.\n");
+}
+
+#define RELAXED_BLOCK 8
+
+static _Atomic unsigned long rlx_sum, rlx_n;
+
+void
+test_relaxed()
+{
+    unsigned long total;
+    pq_t *other;
+
+    printf("test relaxed, %d threads\n", nthreads);
+    rlx = pq_init_relaxed(10, RELAXED_BLOCK);
+
+    /* alone, a thread sees exact order */
+    for (long i = 100; i > 0; i--)
+	insert(rlx, 2 * i, (pval_t) (2 * i));
+    assert((long)deletemin(rlx) == 2);
+    assert((long)deletemin(rlx) == 4);
+    /* a smaller key makes the block stale */
+    insert(rlx, 5, (pval_t) 5);
+    assert((long)deletemin(rlx) == 5);
+    for (long i = 3; i <= 100; i++)
+	assert((long)deletemin(rlx) == 2 * i);
+    assert(deletemin(rlx) == NULL);
+
+    /* put back on flush */
+    insert(rlx, 1, (pval_t) 1);
+    insert(rlx, 2, (pval_t) 2);
+    assert((long)deletemin(rlx) == 1);
+    pq_cache_flush(rlx);
+    insert(rlx, 3, (pval_t) 3);
+    assert((long)deletemin(rlx) == 2);
+    assert((long)deletemin(rlx) == 3);
+    assert(deletemin(rlx) == NULL);
+
+    /* an element whose key is inserted again stays in the block */
+    for (long i = 1; i <= RELAXED_BLOCK; i++)
+	insert(rlx, i, (pval_t) i);
+    assert((long)deletemin(rlx) == 1);
+    insert(rlx, 3, (pval_t) 33);
+    assert((long)deletemin(rlx) == 3);
+    assert((long)deletemin(rlx) == 2);
+    assert((long)deletemin(rlx) == 33);
+    for (long i = 4; i <= RELAXED_BLOCK; i++)
+	assert((long)deletemin(rlx) == i);
+    assert(deletemin(rlx) == NULL);
+    assert(pq_cache_flush(rlx) == 0);
+
+    /* blocks are per queue, and go with it */
+    other = pq_init_relaxed(10, RELAXED_BLOCK);
+    for (long i = 1; i <= 4; i++) {
+	insert(rlx, i, (pval_t) i);
+	insert(other, i, (pval_t) i);
+    }
+    for (long i = 1; i <= 2; i++) {
+	assert((long)deletemin(other) == i);
+	assert((long)deletemin(rlx) == i);
+    }
+    pq_destroy(other);
+    assert((long)deletemin(rlx) == 3);
+    assert((long)deletemin(rlx) == 4);
+    assert(deletemin(rlx) == NULL);
+
+    /* a clear drops the claimed block, twice in a row as well */
+    for (int j = 0; j < 2; j++) {
+	for (long i = 1; i <= 4; i++)
+	    insert(rlx, i, (pval_t) i);
+	assert((long)deletemin(rlx) == 1);
+	pq_clear(rlx);
+	assert(deletemin(rlx) == NULL);
+    }
+    assert(pq_cache_flush(rlx) == 0);
+
+    /* a put back block wakes an eventfd consumer that found the
+     * queue empty while the block was claimed */
+    other = pq_init_relaxed(10, RELAXED_BLOCK);
+    assert(pq_eventfd(other) >= 0);
+    for (long i = 1; i <= 4; i++)
+	insert(other, i, (pval_t) i);
+    assert((long)deletemin(other) == 1);
+    pthread_create(&ts[0], NULL, relaxed_wait_thread, other);
+    (void)pthread_join(ts[0], NULL);
+    assert(!readable(other->efd, 0));
+    assert(pq_cache_flush(other) == 0);
+    assert(readable(other->efd, 0));
+    assert((long)pq_eventfd_deletemin(other) == 2);
+    pq_destroy(other);
+
+    /* every element is taken once */
+    total = nthreads * 10 * PER_THREAD;
+    for (long i = 1; i <= total; i++)
+	insert(rlx, i, (pval_t) i);
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, relaxed_thread, (void *)i);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+    assert(rlx_n == total && rlx_sum == total * (total + 1) / 2);
+    assert(deletemin(rlx) == NULL);
+
+    pq_destroy(rlx);
+    printf("OK.\n");
+}
+
+#define INSBUF 16
+
+static _Atomic unsigned long buf_sum, buf_n;
+/* elements inserted and not yet taken, by the flush test */
+static _Atomic long buf_live, buf_done;
+
+void
+test_buffered()
+{
+    unsigned long total;
+    pq_t *other;
+
+    printf("test buffered, %d threads\n", nthreads);
+    bufq = pq_init_buffered(10, INSBUF);
+
+    /* buffered elements are seen by deletemin */
+    for (long i = 10; i > 0; i--)
+	insert(bufq, i, (pval_t) i);
+    for (long i = 1; i <= 10; i++)
+	assert((long)deletemin(bufq) == i);
+    assert(deletemin(bufq) == NULL);
+
+    /* alone, a thread sees exact order, across flushes */
+    for (long i = 1; i <= 10 * INSBUF; i++)
+	insert(bufq, (i * 7919) % (10 * INSBUF) + 1,
+	       (pval_t) ((i * 7919) % (10 * INSBUF) + 1));
+    for (long i = 1; i <= 5 * INSBUF; i++)
+	assert((long)deletemin(bufq) == i);
+    pq_insert_flush(bufq);
+    for (long i = 5 * INSBUF + 1; i <= 10 * INSBUF; i++)
+	assert((long)deletemin(bufq) == i);
+    assert(deletemin(bufq) == NULL);
+
+    /* one buffer per thread and queue, also when alternating */
+    other = pq_init_buffered(10, INSBUF);
+    for (long i = 1; i <= 4; i++) {
+	insert(bufq, i, (pval_t) i);
+	insert(other, i, (pval_t) i);
+    }
+    assert(atomic_load(&bufq->nlocals) == 1);
+    assert(atomic_load(&other->nlocals) == 1);
+    pq_destroy(other);
+    for (long i = 1; i <= 4; i++)
+	assert((long)deletemin(bufq) == i);
+    assert(deletemin(bufq) == NULL);
+
+    /* buffered elements are cleared with the queue */
+    insert(bufq, 1, (pval_t) 1);
+    pq_clear(bufq);
+    assert(deletemin(bufq) == NULL);
+
+    /* producers leave with elements in their buffers */
+    total = nthreads / 2 * 10 * PER_THREAD;
+    for (long i = 0; i < nthreads; i ++)
+        pthread_create (&ts[i], NULL, buffered_thread, (void *)i);
+    for (long i = 0; i < nthreads; i ++)
+	(void)pthread_join (ts[i], NULL);
+    assert(buf_n == total && buf_sum == total * (total + 1) / 2);
+    assert(deletemin(bufq) == NULL);
+    pq_destroy(bufq);
+
+    /* a deleter finds the elements of a buffer that is being flushed */
+    bufq = pq_init_buffered(10, PQ_INSBUF_MAX);
+    for (long i = 0; i < 3; i ++)
+        pthread_create (&ts[i], NULL, buffered_flush_thread, (void *)i);
+    for (long i = 0; i < 3; i ++)
+	(void)pthread_join (ts[i], NULL);
+    assert(deletemin(bufq) == NULL);
+
+    pq_destroy(bufq);
+    printf("OK.\n");
+}
+
+typedef struct
+{
+    long      id;
+    int       reused;
+    pq_link_t link;
+} elem_t;
+
+static volatile int reused;
+
+static void
+link_reuse(pq_link_t *l)
+{
+    elem_t *t = (elem_t *)((char *)l - offsetof(elem_t, link));
+    t->reused++;
+    __sync_fetch_and_add(&reused, 1);
+}
+
+void
+test_intrusive()
+{
+    int n = nthreads * PER_THREAD;
+    elem_t *ts = calloc(n, sizeof *ts);
+    pq_t *ipq = pq_init_intrusive(10, link_reuse);
+    pq_link_t *l;
+
+    printf("test intrusive\n");
+
+    for (long i = 0; i < n; i++) {
+	ts[i].id = i;
+	assert(pq_link_insert(ipq, &ts[n - 1 - i].link, n - i));
+    }
+    elem_t dup;
+    assert(!pq_link_insert(ipq, &dup.link, 1));
+
+    for (long i = 0; i < n; i++) {
+	l = pq_link_deletemin(ipq);
+	assert(l && l->n.k == i + 1);
+	assert(((elem_t *)((char *)l - offsetof(elem_t, link)))->id == i);
+    }
+    assert(pq_link_deletemin(ipq) == NULL);
+
+    /* pass through enough critical sections for the epochs to move,
+     * until the links not in the deleted prefix have been reused, so
+     * that none is left to the GC when ts is freed */
+    for (int i = 0; i < 100000 && reused + pq_prefix_length(ipq) < n; i++)
+	pq_link_deletemin(ipq);
+    assert(reused > 0);
+
+    pq_destroy(ipq);
+    assert(reused == n);
+    for (long i = 0; i < n; i++)
+	assert(ts[i].reused == 1);
+    free(ts);
+
+    printf("OK.\n");
+}
+
 void
 check_invariants(pq_t *pq) 
 {
@@ -234,6 +1039,186 @@ add_thread(void *id)
 }
 
 
+void *
+index_add_thread(void *id)
+{
+    long base = PER_THREAD * (long)id;
+    for(int i = 0; i < PER_THREAD; i++)
+	pqi_insert(ipq, base+i+1, (pval_t) base+i+1);
+    return NULL;
+}
+
+
+void *
+fat_add_thread(void *id)
+{
+    long base = PER_THREAD * (long)id;
+    /* descending, so that nodes are split and filled at the front */
+    for(int i = PER_THREAD - 1; i >= 0; i--)
+	pqf_insert(fpq, base+i+1, (pval_t) base+i+1);
+    return NULL;
+}
+
+
+/* Deleted keys of a thread, in the order it saw them, are increasing
+ * as long as no smaller key can have been inserted meanwhile. Here,
+ * every thread inserts keys above all its earlier deletions. */
+void *
+fat_mixed_thread(void *id)
+{
+    unsigned long v, ov = 0;
+    for(int i = 0; i < 10 * PER_THREAD; i++) {
+	pqf_insert(fpq, (1000 + i) * nthreads + (long)id + 1,
+		   (pval_t)((1000 + i) * nthreads + (long)id + 1));
+	v = (unsigned long) pqf_deletemin(fpq);
+	assert(v != 0 && v != ov);
+	ov = v;
+    }
+    return NULL;
+}
+
+
+void *
+radix_add_thread(void *id)
+{
+    long base = PER_THREAD * (long)id;
+    for(int i = 0; i < PER_THREAD; i++)
+	pqr_insert(rpq, (base+i+1) * RADIX_STRIDE,
+		   (pval_t)((base+i+1) * RADIX_STRIDE));
+    return NULL;
+}
+
+
+/* As fat_mixed_thread(). */
+void *
+radix_mixed_thread(void *id)
+{
+    unsigned long v, ov = 0;
+    for(int i = 0; i < 10 * PER_THREAD; i++) {
+	pqr_insert(rpq, (1000 + i) * nthreads + (long)id + 1,
+		   (pval_t)((1000 + i) * nthreads + (long)id + 1));
+	v = (unsigned long) pqr_deletemin(rpq);
+	assert(v != 0 && v != ov);
+	ov = v;
+    }
+    return NULL;
+}
+
+
+/* Keys 1 .. 10 * PER_THREAD * nthreads, interleaved between the
+ * threads, from the largest down, so that the bound is exceeded and
+ * the queue trimmed many times. */
+void *
+bounded_add_thread(void *id)
+{
+    for (long i = 10 * PER_THREAD - 1; i >= 0; i--)
+	insert(bpq, i * nthreads + (long)id + 1,
+	       (pval_t)(i * nthreads + (long)id + 1));
+    return NULL;
+}
+
+
+void *
+clear_mixed_thread(void *id)
+{
+    for(int i = 0; i < 100 * PER_THREAD; i++) {
+	insert(cpq, i * nthreads + (long)id + 1,
+	       (pval_t)(i * nthreads + (long)id + 1));
+	if (i & 1) deletemin(cpq);
+    }
+    return NULL;
+}
+
+
+void *
+meld_add_thread(void *id)
+{
+    /* odd threads take elements from dst while the runs go in */
+    if ((long)id & 1) {
+	while (!atomic_load(&meld_done)) {
+	    long k = (long)deletemin(mpq);
+	    if (k)
+		meld_seen[k]++;
+	}
+	return NULL;
+    }
+    for (long i = 0; i < 10 * PER_THREAD; i++) {
+	long k = 2 * (i * nthreads + (long)id) + 1;
+	insert(mpq, k, (pval_t) k);
+    }
+    return NULL;
+}
+
+
+void *
+submit_thread(void *id)
+{
+    for (long i = 0; i < EXEC_TASKS; i++)
+	assert(exec_submit(ex, i % 7, count_task, (void *)1) == 0);
+    return NULL;
+}
+
+
+void *
+eventfd_add_thread(void *id)
+{
+    for (long i = 0; i < 10 * PER_THREAD; i++) {
+	insert(epq, i * nthreads + (long)id + 1,
+	       (pval_t)(i * nthreads + (long)id + 1));
+	if (i % 16 == 0)
+	    usleep(10);
+    }
+    return NULL;
+}
+
+
+void *
+relaxed_thread(void *id)
+{
+    unsigned long v;
+
+    /* half of the threads insert again, below the claimed keys */
+    for (long i = 0; (v = (unsigned long)deletemin(rlx)) != 0; i++) {
+	if ((long)id & 1 && i % 64 == 0) {
+	    insert(rlx, v, (pval_t) v);
+	    continue;
+	}
+	atomic_fetch_add(&rlx_sum, v);
+	atomic_fetch_add(&rlx_n, 1);
+    }
+    pq_cache_flush(rlx);
+    return NULL;
+}
+
+/* Finds the queue empty, and arms its eventfd. */
+void *
+relaxed_wait_thread(void *q)
+{
+    assert(pq_eventfd_deletemin(q) == NULL);
+    return NULL;
+}
+
+
+void *
+buffered_thread(void *id)
+{
+    long p = nthreads / 2, total = p * 10 * PER_THREAD;
+    unsigned long v;
+
+    if ((long)id < p) {
+	for (long i = 0; i < 10 * PER_THREAD; i++)
+	    insert(bufq, i * p + (long)id + 1, (pval_t)(i * p + (long)id + 1));
+	return NULL;
+    }
+    while (atomic_load(&buf_n) < total)
+	if ((v = (unsigned long)deletemin(bufq)) != 0) {
+	    atomic_fetch_add(&buf_sum, v);
+	    atomic_fetch_add(&buf_n, 1);
+	}
+    return NULL;
+}
+
+
 void *
 removemin_thread(void *id)
 {
@@ -247,3 +1232,29 @@ removemin_thread(void *id)
 }
 
 
+/* Thread 0 is the only deleter, so that it must find an element
+ * whenever one is live. */
+void *
+buffered_flush_thread(void *id)
+{
+    long l;
+
+    if ((long)id) {
+	for (long i = 1; i <= 20 * PQ_INSBUF_MAX; i++) {
+	    insert(bufq, 2 * i + (long)id, (pval_t)(2 * i + (long)id));
+	    atomic_fetch_add(&buf_live, 1);
+	}
+	atomic_fetch_add(&buf_done, 1);
+	return NULL;
+    }
+    while (atomic_load(&buf_done) < 2 || atomic_load(&buf_live)) {
+	l = atomic_load(&buf_live);
+	if (deletemin(bufq))
+	    atomic_fetch_sub(&buf_live, 1);
+	else
+	    assert(l == 0);
+    }
+    return NULL;
+}
+
+
@@ -0,0 +1,165 @@
+/**
+ * Tests of the coroutine interface, prioq_coro.hpp.
+ *
+ * Copyright (c) 2018, Jonatan Linden
+ *
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "prioq_coro.hpp"
+
+extern "C" {
+    void _init_gc_subsystem(void);
+    void _destroy_gc_subsystem(void);
+}
+
+#define NTHREADS 8
+#define CONSUMERS 8
+#define PER_CONSUMER 1000
+
+/* runs eagerly, until its first suspension */
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static std::atomic<long> done, sum;
+
+static task
+consumer(pq_async &q, int n)
+{
+    long s = 0;
+
+    for (int i = 0; i < n; i++)
+        s += (long) co_await q.pop();
+    sum += s;
+    done++;
+}
+
+static task
+order(pq_async &q)
+{
+    assert((long) co_await q.pop() == 1);
+    assert((long) co_await q.pop() == 2);
+    assert((long) co_await q.pop() == 3);
+    done++;
+}
+
+static void
+produce(pq_async &q, long id)
+{
+    for (long i = 0; i < CONSUMERS * PER_CONSUMER / NTHREADS; i++) {
+        long k = i * NTHREADS + id + 1;
+        q.push(k, (void *) k);
+    }
+}
+
+static long
+expected_sum()
+{
+    long n = CONSUMERS * PER_CONSUMER;
+    return n * (n + 1) / 2;
+}
+
+static void
+test_ready()
+{
+    pq_async q(10);
+
+    printf("test ready pop\n");
+    done = 0;
+    q.push(3, (void *) 3);
+    q.push(1, (void *) 1);
+    q.push(2, (void *) 2);
+    order(q);
+    assert(done == 1);
+    assert(q.try_pop() == nullptr);
+    printf("OK.\n");
+}
+
+static void
+test_resume()
+{
+    pq_async q(10);
+    std::vector<std::thread> ts;
+
+    printf("test resume by push, %d threads\n", NTHREADS);
+    done = sum = 0;
+    /* all suspend on the empty queue */
+    for (int i = 0; i < CONSUMERS; i++)
+        consumer(q, PER_CONSUMER);
+    assert(done == 0);
+
+    for (long i = 0; i < NTHREADS; i++)
+        ts.emplace_back(produce, std::ref(q), i);
+    for (auto &t : ts)
+        t.join();
+
+    assert(done == CONSUMERS);
+    assert(sum == expected_sum());
+    assert(q.try_pop() == nullptr);
+    printf("OK.\n");
+}
+
+static void
+test_scheduler()
+{
+    std::mutex m;
+    std::deque<std::coroutine_handle<>> ready;
+    pq_async q(10, [&](std::coroutine_handle<> h) {
+        std::lock_guard<std::mutex> g(m);
+        ready.push_back(h);
+    });
+    std::vector<std::thread> ts;
+
+    printf("test scheduler, %d threads\n", NTHREADS);
+    done = sum = 0;
+    for (int i = 0; i < CONSUMERS; i++)
+        consumer(q, PER_CONSUMER);
+
+    for (long i = 0; i < NTHREADS; i++)
+        ts.emplace_back(produce, std::ref(q), i);
+    /* consumers only run here */
+    while (done < CONSUMERS) {
+        std::coroutine_handle<> h;
+        {
+            std::lock_guard<std::mutex> g(m);
+            if (ready.empty())
+                continue;
+            h = ready.front();
+            ready.pop_front();
+        }
+        h.resume();
+    }
+    for (auto &t : ts)
+        t.join();
+
+    assert(sum == expected_sum());
+    assert(q.try_pop() == nullptr);
+    printf("OK.\n");
+}
+
+int
+main()
+{
+    _init_gc_subsystem();
+    test_ready();
+    test_resume();
+    test_scheduler();
+    _destroy_gc_subsystem();
+    return 0;
+}